@@ -0,0 +1,96 @@
+/* Per-message latency of the high level API for small payloads.
+ *
+ * Build with:
+ *
+ * cc small-bench.c ../src/libbz3.c -I../include -o small-bench "-DVERSION=\"0.0.0\"" -O2
+ *
+ * and run next to shakespeare.txt. Every message is compressed and decompressed on its own, as a service handling
+ * requests would: once with `bz3_compress()' and `bz3_decompress()', which set up a state for every call, once
+ * with a context reused across calls, and once more with small blocks enabled on the context, see
+ * `bz3_ctx_set_small_blocks()'. The best of a few rounds is reported, measured in CPU time. */
+
+#include <libbz3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS 5
+
+static double cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+    FILE * fp = fopen("shakespeare.txt", "rb");
+    if (!fp) {
+        printf("Couldn't open shakespeare.txt.\n");
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char * text = malloc(size);
+    fread(text, 1, size, fp);
+    fclose(fp);
+
+    static const size_t sizes[] = { 256, 2048, 16384, 65536 };
+    unsigned char * out = malloc(bz3_bound(65536)), * back = malloc(65536);
+    struct bz3_ctx * ctx = bz3_ctx_new();
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        const size_t n = sizes[s];
+        const int messages = 1000000 / n < 20 ? 20 : 1000000 / n;
+
+        // First with a fresh state for every message, then with one context reused for all of them, with the 65KiB
+        // minimum block size and without.
+        for (int reuse = 0; reuse < 3; reuse++) {
+            double best_enc = 1e9, best_dec = 1e9;
+            bz3_ctx_set_small_blocks(ctx, reuse == 2);
+            size_t total = 0;
+
+            for (int r = 0; r < ROUNDS; r++) {
+                double enc = 0, dec = 0;
+                total = 0;
+                for (int i = 0; i < messages; i++) {
+                    const unsigned char * msg = text + (size_t)i * 7919 % (size - n);
+                    size_t out_size = bz3_bound(n), back_size = n;
+
+                    double t = cpu_time();
+                    int bzerr = reuse ? bz3_compress_ctx(ctx, n, msg, out, n, &out_size)
+                                      : bz3_compress(n, msg, out, n, &out_size);
+                    enc += cpu_time() - t;
+                    if (bzerr != BZ3_OK) {
+                        printf("bz3_compress() failed with error code %d\n", bzerr);
+                        return 1;
+                    }
+
+                    t = cpu_time();
+                    bzerr = reuse ? bz3_decompress_ctx(ctx, out, back, out_size, &back_size)
+                                  : bz3_decompress(out, back, out_size, &back_size);
+                    dec += cpu_time() - t;
+                    if (bzerr != BZ3_OK || back_size != n || memcmp(back, msg, n)) {
+                        printf("bz3_decompress() failed with error code %d\n", bzerr);
+                        return 1;
+                    }
+
+                    total += out_size;
+                }
+                if (enc < best_enc) best_enc = enc;
+                if (dec < best_dec) best_dec = dec;
+            }
+
+            static const char * const modes[] = { "", ", context", ", small blocks" };
+            printf("%6zu bytes%-14s: compress %8.1f us, decompress %8.1f us, ratio %.2f%%\n", n, modes[reuse], best_enc * 1e6 / messages, best_dec * 1e6 / messages,
+                   total * 100.0 / ((double)n * messages));
+        }
+    }
+
+    bz3_ctx_free(ctx);
+    free(text);
+    free(out);
+    free(back);
+    return 0;
+}
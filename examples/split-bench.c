@@ -0,0 +1,81 @@
+/* Ratio and wall-clock time of splitting a file into more blocks for the threads to share.
+ *
+ * Build with:
+ *
+ * cc split-bench.c ../src/libbz3.c -I../include -o split-bench "-DVERSION=\"0.0.0\"" -DPTHREAD -O2 -pthread
+ *
+ * and run as `split-bench FILE [LEVEL]'. The file is compressed with `bz3_compress_mt()' and as many threads as
+ * `bz3_auto_threads()' allows, once with the block size of the level and once with the one suggested by
+ * `bz3_split_block_size()'. The best of a few rounds is reported, measured in wall-clock time. On a machine with a
+ * single CPU available, both take about as long. */
+
+#include <libbz3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUNDS 3
+
+static double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char * argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s FILE [LEVEL]\n", argv[0]);
+        return 1;
+    }
+    const int level = argc > 2 ? atoi(argv[2]) : BZ3_LEVEL_DEFAULT;
+    if (bz3_level_block_size(level) < 0) {
+        printf("Invalid level: %s\n", argv[2]);
+        return 1;
+    }
+
+    FILE * fp = fopen(argv[1], "rb");
+    if (!fp) {
+        printf("Couldn't open %s.\n", argv[1]);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char * in = malloc(size), * out = malloc(bz3_bound(size));
+    if (!in || !out || fread(in, 1, size, fp) != size) {
+        printf("Couldn't read %s.\n", argv[1]);
+        return 1;
+    }
+    fclose(fp);
+
+    const int block_size = bz3_level_block_size(level);
+    const int threads = bz3_auto_threads(0, block_size);
+    const int sizes[] = { block_size, bz3_split_block_size(size, block_size, threads) };
+    size_t base = 0;
+
+    printf("%zu bytes, level %d, %d thread(s)\n", size, level, threads);
+    for (int s = 0; s < 2; s++) {
+        double best = 1e9;
+        size_t out_size = 0;
+
+        for (int r = 0; r < ROUNDS; r++) {
+            out_size = bz3_bound(size);
+            double t = wall_time();
+            int bzerr = bz3_compress_mt(sizes[s], threads, in, out, size, &out_size);
+            t = wall_time() - t;
+            if (bzerr != BZ3_OK) {
+                printf("bz3_compress_mt() failed with error code %d\n", bzerr);
+                return 1;
+            }
+            if (t < best) best = t;
+        }
+        if (!s) base = out_size;
+
+        printf("%6d KiB blocks (%3zu): %10zu bytes (%+.1f%%), %7.2f s\n", sizes[s] / 1024,
+               (size + sizes[s] - 1) / sizes[s], out_size, (out_size - (double)base) * 100.0 / base, best);
+    }
+
+    free(in);
+    free(out);
+    return 0;
+}
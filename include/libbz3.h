@@ -53,8 +53,55 @@ extern "C" {
 #define BZ3_ERR_DATA_TOO_BIG -6
 #define BZ3_ERR_INIT -7
 #define BZ3_ERR_DATA_SIZE_TOO_SMALL -8
+#define BZ3_ERR_UNSUPPORTED -9
+#define BZ3_ERR_DICTIONARY -10
+#define BZ3_ERR_CANCELED -11
+
+/**
+ * @brief State flags accepted by `bz3_new_flags()' and `bz3_min_memory_needed_flags()'.
+ *
+ * BZ3_FLAG_LOW_MEMORY: Create a decode-only state that inverts the Burrows-Wheeler transform using
+ * a sampled occurrence table instead of the suffix array sized buffer. This brings the memory
+ * footprint of a state down from about 5x to about 1.5x the block size, at the cost of slower
+ * decompression. `bz3_encode_block()' fails with BZ3_ERR_UNSUPPORTED on such states.
+ */
+#define BZ3_FLAG_LOW_MEMORY 0x01
+
+/**
+ * BZ3_FLAG_IN_PLACE: Create a state without the `bz3_bound(block_size)' byte swap buffer. The transforms
+ * run in the caller's buffer instead, borrowing the SAIS array as scratch space while it is not in use.
+ * This saves about one block size worth of memory per state, at the cost of a few extra copies per
+ * block. Has no effect together with `BZ3_FLAG_LOW_MEMORY'.
+ */
+#define BZ3_FLAG_IN_PLACE 0x02
+
+/**
+ * BZ3_FLAG_HUGETLB: On Linux, back the block sized buffers with pages from the hugetlbfs pool
+ * (see /proc/sys/vm/nr_hugepages). If the pool can't satisfy an allocation, transparent huge pages
+ * are requested instead with MADV_HUGEPAGE. Without this flag, the buffers come from malloc() like
+ * the rest of the state. Ignored on other systems.
+ */
+#define BZ3_FLAG_HUGETLB 0x04
+
+/**
+ * @brief Compression levels accepted by `bz3_set_level()', from the fastest to the strongest. The default level
+ * produces the same output as states that never had their level set.
+ */
+#define BZ3_LEVEL_MIN 1
+#define BZ3_LEVEL_DEFAULT 5
+#define BZ3_LEVEL_MAX 9
+
+/**
+ * @brief The longest history a dictionary can hold, see `bz3_train_dict()'.
+ */
+#define BZ3_DICT_MAX_HISTORY (1 << 20)
 
 struct bz3_state;
+struct bz3_dict;
+struct bz3_ctx;
+struct bz3_batch;
+struct bz3_pool;
+struct bz3_job;
 
 /**
  * @brief Get bzip3 version.
@@ -74,10 +121,66 @@ BZIP3_API const char * bz3_strerror(struct bz3_state * state);
 /**
  * @brief Construct a new block encoder state, which will encode blocks as big as the given block size.
  * The decoder will be able to decode blocks at most as big as the given block size.
- * Returns NULL in case allocation fails or the block size is not between 65K and 511M
+ * Returns NULL in case allocation fails or the block size is not between 1 and 511M.
+ *
+ * States smaller than 65K, the smallest block size of the file format, size their tables to the block
+ * size as well, which makes them much faster to set up and use for small messages. Blocks encoded by
+ * such states can be decoded by any state big enough to hold them, but they can only decode blocks
+ * made by states of the same kind. Older versions of the library can't decode them at all.
  */
 BZIP3_API struct bz3_state * bz3_new(int32_t block_size);
 
+/**
+ * @brief Construct a new block encoder state, like `bz3_new()', with the behaviour adjusted by the
+ * `BZ3_FLAG_*' flags given. `bz3_new_flags(block_size, 0)' is equivalent to `bz3_new(block_size)'.
+ */
+BZIP3_API struct bz3_state * bz3_new_flags(int32_t block_size, int32_t flags);
+
+/**
+ * @brief A memory allocator for `bz3_new_ex()'. `alloc' must return a block of at least `size' bytes aligned for
+ * any type, or NULL on failure. `free' releases a block returned by `alloc'. Both are passed `opaque'.
+ */
+struct bz3_allocator {
+    void * (*alloc)(void * opaque, size_t size);
+    void (*free)(void * opaque, void * ptr);
+    void * opaque;
+};
+
+/**
+ * @brief Construct a new block encoder state, like `bz3_new_flags()', taking all of its memory from the given
+ * allocator, which must remain usable until the state is freed. Huge pages (see `BZ3_FLAG_HUGETLB') are up to the
+ * allocator. A NULL allocator makes this equivalent to `bz3_new_flags()'.
+ *
+ * The state doesn't allocate anything after it has been created, until `bz3_free()' hands its memory back to the
+ * allocator. This includes the 272KiB model of the strong entropy coder, which states made without an allocator only
+ * set aside once they encode at level 7 to 9, or decode a block that was. Note that the Burrows-Wheeler transform
+ * still allocates some temporary tables, a few hundred KiB in size, with malloc() while encoding or decoding a block.
+ */
+BZIP3_API struct bz3_state * bz3_new_ex(int32_t block_size, int32_t flags, const struct bz3_allocator * allocator);
+
+/**
+ * @brief Construct a new block encoder state, like `bz3_new_flags()', within a caller-provided workspace of
+ * `workspace_size' bytes, at least `bz3_min_memory_needed_flags(block_size, flags)'. The workspace must outlive
+ * the state and needn't be freed through `bz3_free()', which is allowed but doesn't release anything.
+ * Returns NULL if the workspace is too small or the block size is invalid.
+ */
+BZIP3_API struct bz3_state * bz3_new_workspace(int32_t block_size, int32_t flags, void * workspace,
+                                               size_t workspace_size);
+
+/**
+ * @brief Set the compression level used by `bz3_encode_block()' on this state, between `BZ3_LEVEL_MIN' and
+ * `BZ3_LEVEL_MAX'. Lower levels collapse more repetitions before the Burrows-Wheeler transform and switch to a
+ * simpler entropy coder, higher levels use a stronger one. The level is recorded in every block, so any state can
+ * decode blocks encoded at any level. Returns BZ3_OK, or BZ3_ERR_UNSUPPORTED if the level is out of range.
+ */
+BZIP3_API int32_t bz3_set_level(struct bz3_state * state, int32_t level);
+
+/**
+ * @brief Return the block size suggested for the given compression level, or -1 if the level is out of range.
+ * Smaller blocks are faster to transform, larger blocks compress better; see etc/BENCHMARKS.md.
+ */
+BZIP3_API int32_t bz3_level_block_size(int32_t level);
+
 /**
  * @brief Free the memory occupied by a block encoder state.
  */
@@ -96,7 +199,8 @@ BZIP3_API size_t bz3_bound(size_t input_size);
  * Using the low level API might provide better performance.
  * Returns a bzip3 error code; BZ3_OK when the operation is successful.
  * Make sure to set out_size to the size of the output buffer before the operation;
- * out_size must be at least equal to `bz3_bound(in_size)'.
+ * out_size must be at least equal to `bz3_bound(in_size)'. Incompressible input split into blocks of a few KiB or
+ * less can need more than that, since every block has headers of its own; BZ3_ERR_DATA_TOO_BIG is returned then.
  */
 BZIP3_API int bz3_compress(uint32_t block_size, const uint8_t * in, uint8_t * out, size_t in_size, size_t * out_size);
 
@@ -106,9 +210,110 @@ BZIP3_API int bz3_compress(uint32_t block_size, const uint8_t * in, uint8_t * ou
  * Using the low level API might provide better performance.
  * Returns a bzip3 error code; BZ3_OK when the operation is successful.
  * Make sure to set out_size to the size of the output buffer before the operation.
+ * The blocks are decoded straight from `in' into their place in `out', without copies in between, except for
+ * blocks that need more room along the way than the output has left; those go through a buffer of their own.
+ * Frames compressed with a dictionary fail with BZ3_ERR_DICTIONARY, see `bz3_decompress_dict()'.
  */
 BZIP3_API int bz3_decompress(const uint8_t * in, uint8_t * out, size_t in_size, size_t * out_size);
 
+/**
+ * @brief Compress a frame like `bz3_compress()', encoding up to `threads' blocks at a time. The output is the same as
+ * that of `bz3_compress()'. Every thread allocates a block encoder state of its own, so the memory needed grows
+ * with the thread count; see `bz3_min_memory_needed()'. Without pthread support, this is `bz3_compress()'.
+ * Returns BZ3_ERR_INIT if `threads' is below 1.
+ */
+BZIP3_API int bz3_compress_mt(uint32_t block_size, int32_t threads, const uint8_t * in, uint8_t * out, size_t in_size,
+                              size_t * out_size);
+
+/**
+ * @brief Decompress a frame like `bz3_decompress()', decoding up to `threads' blocks at a time straight into their
+ * place in `out'. On failure, the error and the output size are those of `bz3_decompress()'.
+ */
+BZIP3_API int bz3_decompress_mt(int32_t threads, const uint8_t * in, uint8_t * out, size_t in_size,
+                                size_t * out_size);
+
+/**
+ * @brief Construct a context for `bz3_compress_ctx()' and `bz3_decompress_ctx()', which keep their state and
+ * buffer in it from one call to the next instead of allocating them every time. The context grows when it is
+ * given a bigger block size, and holds on to the memory until `bz3_ctx_free()'. A context must only be used by
+ * one thread at a time. Returns NULL if allocation fails.
+ */
+BZIP3_API struct bz3_ctx * bz3_ctx_new(void);
+
+/**
+ * @brief Free a context and the memory it holds.
+ */
+BZIP3_API void bz3_ctx_free(struct bz3_ctx * ctx);
+
+/**
+ * @brief Make the context compress frames with the dictionary, as `bz3_compress_dict()' does, and decompress
+ * frames compressed with it, or stop doing so if `dict' is NULL. Returns BZ3_OK.
+ */
+BZIP3_API int bz3_ctx_set_dict(struct bz3_ctx * ctx, const struct bz3_dict * dict);
+
+/**
+ * @brief Let the context compress frames with blocks below 65KiB, the minimum of the original format: a block size
+ * given below it is used as is, and inputs smaller than the block size get one fitted to them instead of 65KiB. The
+ * state and its LZP table are then sized to the input, which saves about a third of the time it takes to compress a
+ * message of a few hundred bytes; past a few KiB, it makes no measurable difference. See etc/BENCHMARKS.md. Such
+ * frames, and their blocks, can only be decompressed by this version of the library or later: older versions fail
+ * with BZ3_ERR_INIT or BZ3_ERR_MALFORMED_HEADER. Off by default. Returns BZ3_OK.
+ */
+BZIP3_API int bz3_ctx_set_small_blocks(struct bz3_ctx * ctx, int enable);
+
+/**
+ * @brief Compress a frame like `bz3_compress()', reusing the memory of the context. The output is the same.
+ */
+BZIP3_API int bz3_compress_ctx(struct bz3_ctx * ctx, uint32_t block_size, const uint8_t * in, uint8_t * out,
+                               size_t in_size, size_t * out_size);
+
+/**
+ * @brief Decompress a frame like `bz3_decompress()', reusing the memory of the context.
+ */
+BZIP3_API int bz3_decompress_ctx(struct bz3_ctx * ctx, const uint8_t * in, uint8_t * out, size_t in_size,
+                                 size_t * out_size);
+
+/**
+ * @brief Construct a batch, which compresses or decompresses many independent frames at once on up to `threads'
+ * threads, the calling one included. Each thread keeps a context of its own in the batch, so the memory is reused
+ * from one call to the next. Where `bz3_encode_blocks()' splits one big input into blocks, a batch is meant for
+ * many small, unrelated inputs, such as messages or records. Without pthread support, a batch runs on the calling
+ * thread only. Returns NULL if `threads' is below 1 or allocation fails.
+ */
+BZIP3_API struct bz3_batch * bz3_batch_new(int32_t threads);
+
+/**
+ * @brief Free a batch and the memory it holds.
+ */
+BZIP3_API void bz3_batch_free(struct bz3_batch * batch);
+
+/**
+ * @brief Make every thread of the batch use the dictionary, as `bz3_ctx_set_dict()' does. Returns BZ3_OK.
+ */
+BZIP3_API int bz3_batch_set_dict(struct bz3_batch * batch, const struct bz3_dict * dict);
+
+/**
+ * @brief Make every thread of the batch compress with small blocks, as `bz3_ctx_set_small_blocks()' does.
+ * Returns BZ3_OK.
+ */
+BZIP3_API int bz3_batch_set_small_blocks(struct bz3_batch * batch, int enable);
+
+/**
+ * @brief Compress the `n' buffers `in[i]' of `in_sizes[i]' bytes into a frame each, written to `out[i]', exactly as
+ * `bz3_compress()' would. Set `out_sizes[i]' to the size of each output buffer beforehand; on return it holds the
+ * size of the frame. The items are handed out to the threads largest first, as threads become free, and
+ * `status[i]' receives the error code of each. Returns BZ3_OK if every item succeeded, otherwise the error code of
+ * the first item that failed. A batch must only be used by one call at a time.
+ */
+BZIP3_API int bz3_batch_compress(struct bz3_batch * batch, uint32_t block_size, size_t n, const uint8_t * const in[],
+                                 const size_t in_sizes[], uint8_t * const out[], size_t out_sizes[], int status[]);
+
+/**
+ * @brief Decompress `n' independent frames, like `bz3_batch_compress()' in reverse.
+ */
+BZIP3_API int bz3_batch_decompress(struct bz3_batch * batch, size_t n, const uint8_t * const in[],
+                                   const size_t in_sizes[], uint8_t * const out[], size_t out_sizes[], int status[]);
+
 /**
  * @brief Calculate the minimal memory required for compression with the given block size.
  * This includes all internal buffers and state structures. This calculates the amount of bytes
@@ -121,7 +326,7 @@ BZIP3_API int bz3_decompress(const uint8_t * in, uint8_t * out, size_t in_size,
  *      - Core state structure (sizeof(struct bz3_state))
  *      - Swap buffer (bz3_bound(block_size) bytes)
  *      - SAIS array (BWT_BOUND(block_size) * sizeof(int32_t) bytes)
- *      - LZP lookup table ((1 << LZP_DICTIONARY) * sizeof(int32_t) bytes)
+ *      - LZP lookup table (1MiB, or 4 bytes per byte of the block size rounded up to a power of two below 65K)
  *      - Compression state (sizeof(state))
  *    - All memory remains allocated until bz3_free()
  * 
@@ -166,6 +371,136 @@ BZIP3_API int bz3_decompress(const uint8_t * in, uint8_t * out, size_t in_size,
  */
 BZIP3_API size_t bz3_min_memory_needed(int32_t block_size);
 
+/**
+ * @brief Calculate the amount of bytes that will be allocated by a call to `bz3_new_flags()', which is
+ * also the workspace size needed by `bz3_new_workspace()'.
+ *
+ * With `BZ3_FLAG_LOW_MEMORY', the SAIS array is replaced by a sampled occurrence table of
+ * roughly `bz3_bound(block_size) / 2' bytes, so decoding needs about 1.5x the block size
+ * on top of the caller's buffer instead of about 5x. With `BZ3_FLAG_IN_PLACE', the swap buffer
+ * is left out, bringing it down to about 4x.
+ *
+ * @param block_size The block size to be used
+ * @param flags The `BZ3_FLAG_*' flags the state will be created with
+ * @return The total number of bytes required, or 0 if block_size is invalid
+ */
+BZIP3_API size_t bz3_min_memory_needed_flags(int32_t block_size, int32_t flags);
+
+/**
+ * @brief Find the largest amount of parallel workers that fit in a memory budget.
+ *
+ * Every worker is assumed to own a state and a `bz3_bound(block_size)' byte buffer for the block it
+ * processes, as with `bz3_encode_blocks()' and `bz3_decode_blocks()'. On input, `flags' holds the flags
+ * the states are going to be created with, plus any memory saving flags (`BZ3_FLAG_IN_PLACE', or
+ * `BZ3_FLAG_LOW_MEMORY' when decoding) the caller is willing to accept. On output, it holds the flags
+ * that the states should be created with. The configuration allowing for the most workers wins; ties
+ * favour faster ones.
+ *
+ * @param memory_budget The amount of bytes available
+ * @param block_size The block size to be used
+ * @param max_workers The amount of workers wanted, at least 1
+ * @param flags The `BZ3_FLAG_*' flags, see above
+ * @return The amount of workers between 1 and `max_workers', or 0 if not even one worker fits or
+ *         the block size is invalid.
+ */
+BZIP3_API int32_t bz3_plan_workers(size_t memory_budget, int32_t block_size, int32_t max_workers, int32_t * flags);
+
+/**
+ * @brief Suggest an amount of threads for `bz3_compress_mt()', `bz3_decompress_mt()', a pool or a batch: the CPUs
+ * this process may run on, as set by its CPU affinity and, on Linux, by the CPU quota of its control group (`cpu.max'
+ * on cgroup v2, rounded up to whole CPUs), and no more than there are blocks. Pass the size of the data before
+ * compression, or 0 if it isn't known, to leave out the last limit. Combine with `bz3_plan_workers()' to stay
+ * within a memory budget. Returns 1 without pthread support.
+ *
+ * @param in_size The amount of data to be split into blocks, or 0
+ * @param block_size The block size to be used
+ * @return The amount of threads, at least 1
+ */
+BZIP3_API int32_t bz3_auto_threads(size_t in_size, int32_t block_size);
+
+/**
+ * @brief The memory limit of the control group of this process, or the smallest of those of its ancestors: `memory.max'
+ * on cgroup v2 and, without one there, `memory.limit_in_bytes' of the memory controller on cgroup v1. Pass it to
+ * `bz3_plan_workers()' as the budget. Returns 0 if there is no limit, and off Linux.
+ */
+BZIP3_API size_t bz3_memory_limit(void);
+
+/**
+ * @brief Suggest a block size no larger than `block_size' that splits `in_size' bytes into at least `blocks' blocks,
+ * so that as many threads get a block each, but never below 4MiB, where the ratio starts to suffer noticeably. The
+ * result is a multiple of 64KiB and can be passed to `bz3_compress_mt()' or written to a stream header like any
+ * other block size; decoders need nothing new. Returns `block_size' if it is 4MiB or less, if `blocks' is 1 or less,
+ * or if `in_size' is 0.
+ *
+ * @param in_size The amount of data to be split into blocks
+ * @param block_size The largest block size wanted, such as `bz3_level_block_size()'
+ * @param blocks The amount of blocks wanted, such as `bz3_auto_threads(0, block_size)'
+ * @return The block size to use
+ */
+BZIP3_API int32_t bz3_split_block_size(size_t in_size, int32_t block_size, int32_t blocks);
+
+/* ** DICTIONARIES ** */
+
+/**
+ * @brief Return the size of a dictionary holding `history_size' bytes of history, as produced by `bz3_train_dict()'.
+ * This is the history plus about 146KiB for the primed entropy coder model.
+ */
+BZIP3_API size_t bz3_dict_bound(size_t history_size);
+
+/**
+ * @brief Train a dictionary for compressing many small, similar inputs, such as the `n_samples' samples laid out
+ * back to back at `samples', with their sizes in `sample_sizes'.
+ *
+ * A dictionary holds a history of the segments the samples have most in common, which LZP can refer to, and the
+ * entropy coder model left over from compressing the samples one after another, which it starts from instead of a
+ * blank one. The history takes all of the space of `dict' that the model doesn't, up to `BZ3_DICT_MAX_HISTORY' bytes
+ * or the total size of the samples; `bz3_dict_bound()' gives the size needed for a given history.
+ *
+ * A `dict_id' of 0 derives the identifier from the contents of the dictionary.
+ * Returns a bzip3 error code; BZ3_OK when the operation is successful. Make sure to set `dict_size' to the size of
+ * the buffer at `dict' before the operation; it receives the size of the dictionary.
+ */
+BZIP3_API int bz3_train_dict(const uint8_t * samples, const size_t * sample_sizes, size_t n_samples, uint32_t dict_id,
+                             uint8_t * dict, size_t * dict_size);
+
+/**
+ * @brief Load a dictionary produced by `bz3_train_dict()'. The dictionary is read-only once loaded and can be shared
+ * by any amount of states and threads. Returns NULL if the dictionary is malformed or allocation fails.
+ */
+BZIP3_API struct bz3_dict * bz3_dict_new(const uint8_t * dict, size_t dict_size);
+
+/**
+ * @brief Return the identifier of a dictionary, which frames compressed with it record.
+ */
+BZIP3_API uint32_t bz3_dict_id(const struct bz3_dict * dict);
+
+/**
+ * @brief Free a dictionary. States using it must be freed, or switched to another dictionary, first.
+ */
+BZIP3_API void bz3_dict_free(struct bz3_dict * dict);
+
+/**
+ * @brief Make `bz3_encode_block()' use the dictionary for the blocks it encodes, and `bz3_decode_block()' decode
+ * blocks encoded with it, or stop doing so if `dict' is NULL. Blocks record whether they use a dictionary, but not
+ * which one: decoding with another dictionary fails the CRC check, and without one, with BZ3_ERR_DICTIONARY.
+ * Returns BZ3_OK.
+ */
+BZIP3_API int32_t bz3_set_dict(struct bz3_state * state, const struct bz3_dict * dict);
+
+/**
+ * @brief Compress a frame like `bz3_compress()', using a dictionary. The frame records the identifier of the
+ * dictionary and can only be decompressed with `bz3_decompress_dict()'.
+ */
+BZIP3_API int bz3_compress_dict(uint32_t block_size, const struct bz3_dict * dict, const uint8_t * in, uint8_t * out,
+                                size_t in_size, size_t * out_size);
+
+/**
+ * @brief Decompress a frame like `bz3_decompress()', which also accepts frames compressed with a dictionary.
+ * Returns BZ3_ERR_DICTIONARY if the frame needs a dictionary and `dict' is NULL or has another identifier.
+ */
+BZIP3_API int bz3_decompress_dict(const struct bz3_dict * dict, const uint8_t * in, uint8_t * out, size_t in_size,
+                                  size_t * out_size);
+
 /* ** LOW LEVEL APIs ** */
 
 /**
@@ -212,6 +547,80 @@ BZIP3_API void bz3_encode_blocks(struct bz3_state * states[], uint8_t * buffers[
 BZIP3_API void bz3_decode_blocks(struct bz3_state * states[], uint8_t * buffers[], size_t buffer_sizes[], int32_t sizes[],
                                  int32_t orig_sizes[], int32_t n);
 
+/**
+ * @brief Called on a thread of the pool once a job is complete. It may free the job.
+ */
+typedef void (*bz3_job_done)(struct bz3_job * job, void * user);
+
+/**
+ * @brief Construct a pool of `threads' threads, each with a block encoder state of `block_size' bytes, which run
+ * block jobs in the background, in the order they are submitted. Meant for event loops, which can't wait for a block
+ * to encode, nor afford a thread for every request. Returns NULL if `threads' is below 1, or any of the threads or
+ * states can't be created.
+ *
+ * Present in the shared library only if -lpthread was present during building.
+ */
+BZIP3_API struct bz3_pool * bz3_pool_new(int32_t threads, int32_t block_size);
+
+/**
+ * @brief Free a pool. Jobs still queued are canceled, which completes them with BZ3_ERR_CANCELED; the ones already
+ * running are waited for. Completed jobs that haven't been polled yet stay valid until `bz3_job_free()'.
+ */
+BZIP3_API void bz3_pool_free(struct bz3_pool * pool);
+
+/**
+ * @brief Return a file descriptor that polls readable for as long as `bz3_pool_poll()' has jobs to return, for use
+ * with poll, epoll and the like. It must not be read from or closed. Returns -1 on Windows.
+ */
+BZIP3_API int bz3_pool_fd(struct bz3_pool * pool);
+
+/**
+ * @brief Submit a job that encodes a block, as `bz3_encode_block()' would. `buffer' must stay around and untouched
+ * until the job is complete. If `done' isn't NULL, it is called with `user' once the job is complete; otherwise the
+ * job is handed back by `bz3_pool_poll()'. Either way, the job belongs to the caller, who frees it with
+ * `bz3_job_free()' after it is complete. Returns NULL if allocation fails.
+ */
+BZIP3_API struct bz3_job * bz3_pool_encode(struct bz3_pool * pool, uint8_t * buffer, int32_t size, bz3_job_done done,
+                                           void * user);
+
+/**
+ * @brief Submit a job that decodes a block, as `bz3_decode_block()' would. Same specifics as `bz3_pool_encode()'.
+ */
+BZIP3_API struct bz3_job * bz3_pool_decode(struct bz3_pool * pool, uint8_t * buffer, size_t buffer_size,
+                                           int32_t compressed_size, int32_t orig_size, bz3_job_done done, void * user);
+
+/**
+ * @brief Return the next completed job that was submitted without a callback, in the order they completed, or NULL
+ * if there is none. With `wait', block until there is one, unless no such job is outstanding.
+ */
+BZIP3_API struct bz3_job * bz3_pool_poll(struct bz3_pool * pool, int wait);
+
+/**
+ * @brief Cancel a job that hasn't started yet. It completes right away with BZ3_ERR_CANCELED, and is handed to its
+ * callback or to `bz3_pool_poll()' as usual. Returns 1 if the job was canceled, 0 if it is already running or done.
+ */
+BZIP3_API int bz3_pool_cancel(struct bz3_pool * pool, struct bz3_job * job);
+
+/**
+ * @brief Return the error code of a completed job; BZ3_OK when the operation was successful.
+ */
+BZIP3_API int bz3_job_status(const struct bz3_job * job);
+
+/**
+ * @brief Return the size that `bz3_encode_block()' or `bz3_decode_block()' returned for a completed job.
+ */
+BZIP3_API int32_t bz3_job_size(const struct bz3_job * job);
+
+/**
+ * @brief Return the `user' pointer a job was submitted with.
+ */
+BZIP3_API void * bz3_job_user(const struct bz3_job * job);
+
+/**
+ * @brief Free a completed job.
+ */
+BZIP3_API void bz3_job_free(struct bz3_job * job);
+
 /**
  * @brief Check if using original file size as buffer size is sufficient for decompressing
  * a block at `block` pointer.
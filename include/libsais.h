@@ -4531,11 +4531,12 @@ static void libsais_unbwt_compute_bigram_histogram_single(const u8 * RESTRICT T,
     libsais_unbwt_transpose_bucket2(bucket2);
 }
 
-static void libsais_unbwt_calculate_fastbits(sa_uint_t * RESTRICT bucket2, u16 * RESTRICT fastbits, fast_uint_t lastc,
-                                             fast_uint_t shift) {
-    fast_uint_t v, w, sum, c, d;
+static fast_uint_t libsais_unbwt_calculate_fastbits(sa_uint_t * RESTRICT bucket2, u16 * RESTRICT fastbits,
+                                                    fast_uint_t lastc, fast_uint_t shift) {
+    fast_uint_t v, w, sum, c, d, gap = 0;
     for (v = 0, w = 0, sum = 1, c = 0; c < ALPHABET_SIZE; ++c) {
         if (c == lastc) {
+            gap = sum;
             sum += 1;
         }
 
@@ -4550,6 +4551,8 @@ static void libsais_unbwt_calculate_fastbits(sa_uint_t * RESTRICT bucket2, u16 *
             }
         }
     }
+
+    return gap;
 }
 
 static void libsais_unbwt_calculate_biPSI(const u8 * RESTRICT T, sa_uint_t * RESTRICT P, sa_uint_t * RESTRICT bucket1,
@@ -4612,8 +4615,14 @@ static void libsais_unbwt_init_single(const u8 * RESTRICT T, sa_uint_t * RESTRIC
     memset(bucket2, 0, ALPHABET_SIZE * ALPHABET_SIZE * sizeof(sa_uint_t));
     libsais_unbwt_compute_bigram_histogram_single(T, bucket1, bucket2, index);
 
-    libsais_unbwt_calculate_fastbits(bucket2, fastbits, lastc, shift);
+    fast_uint_t gap = libsais_unbwt_calculate_fastbits(bucket2, fastbits, lastc, shift);
     libsais_unbwt_calculate_biPSI(T, P, bucket1, bucket2, index, 0, n);
+
+    /* P[1..n] is filled by libsais_unbwt_calculate_biPSI except for the gap left for the last symbol.
+       P[0] and P[gap] can still be reached when decoding a malformed BWT, so define them instead of
+       requiring the caller to clear P beforehand. */
+    P[0] = 0;
+    P[gap] = 0;
 }
 static void libsais_unbwt_decode_1(u8 * RESTRICT U, sa_uint_t * RESTRICT P, sa_uint_t * RESTRICT bucket2,
                                    u16 * RESTRICT fastbits, fast_uint_t shift, fast_uint_t * i0, fast_uint_t k) {
@@ -17,17 +17,30 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
 #include "libbz3.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "libsais.h"
 
+#if defined(__linux__)
+    #include <limits.h>
+    #include <sched.h>
+    #include <sys/mman.h>
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
     #define LIKELY(x)   __builtin_expect(!!(x), 1)
     #define UNLIKELY(x) __builtin_expect(!!(x), 0)
+    #define ALWAYS_INLINE inline __attribute__((always_inline))
 #else
     #define LIKELY(x)   (x)
     #define UNLIKELY(x) (x)
+    #define ALWAYS_INLINE inline
 #endif
 
 /* CRC32 implementation. Since CRC32 generally takes less than 1% of the runtime on real-world data (e.g. the
@@ -71,6 +84,10 @@ static u32 crc32sum(u32 crc, u8 * RESTRICT buf, size_t size) {
     return crc;
 }
 
+/* The last decoding stage checksums its output in chunks of this size as it goes, while they are still in cache,
+   instead of leaving it to a separate pass over the whole block. */
+#define CRC_CHUNK KiB(32)
+
 /* LZP code. These constants were manually tuned to give the best compression ratio while using relatively
    little resources. The LZP dictionary is only around 1MiB in size and the minimum match length was chosen
    so that LZP would not interfere too much with the Burrows-Wheeler transform and the arithmetic coder, and
@@ -84,8 +101,23 @@ static u32 crc32sum(u32 crc, u8 * RESTRICT buf, size_t size) {
 #define LZP_DICTIONARY 18
 #define LZP_MIN_MATCH 40
 
+/* Used by the fast compression levels: more matches get collapsed, which shrinks the input of the BWT. */
+#define LZP_MIN_MATCH_SHORT 16
+
 #define MATCH 0xf2
 
+/* The lookup table has `1 << LZP_DICTIONARY' entries. Blocks of small states hash into a table sized to the data
+   instead, so that clearing it doesn't take longer than compressing them. */
+static s32 lzp_bits(s32 n) {
+    s32 bits = 8;
+    while (bits < LZP_DICTIONARY && (1 << bits) < n) bits++;
+    return bits;
+}
+
+/* States that can hold the smallest block of the original format keep the full table, so that they decode every
+   block made by a state of any size. */
+static s32 lzp_state_bits(s32 block_size) { return block_size < KiB(65) ? lzp_bits(block_size) : LZP_DICTIONARY; }
+
 static u32 lzp_upcast(const u8 * ptr) {
     // val = *(u32 *)ptr; - written this way to avoid UB
     u32 val;
@@ -121,8 +153,10 @@ static int bz3_check_buffer_size(size_t buffer_size, s32 lzp_size, s32 rle_size,
     return (effective_lzp_size <= buffer_size) && (effective_rle_size <= buffer_size) && (effective_orig_size <= buffer_size);
 }
 
+/* LZP can also refer to a history preceding the block, ending at `hist_end', as given by a dictionary. Positions in
+   the history are stored in the lookup table as negative offsets from its end, see lzp_prime. */
 static s32 lzp_encode_block(const u8 * RESTRICT in, const u8 * in_end, u8 * RESTRICT out, u8 * out_end,
-                            s32 * RESTRICT lut) {
+                            s32 * RESTRICT lut, u32 mask, s32 min_match, const u8 * hist_end) {
     const u8 * ins = in;
     const u8 * outs = out;
     const u8 * out_eob = out_end - 8;
@@ -134,36 +168,44 @@ static s32 lzp_encode_block(const u8 * RESTRICT in, const u8 * in_end, u8 * REST
 
     ctx = ((u32)in[-1]) | (((u32)in[-2]) << 8) | (((u32)in[-3]) << 16) | (((u32)in[-4]) << 24);
 
-    while (in < in_end - LZP_MIN_MATCH - 32 && out < out_eob) {
-        u32 idx = (ctx >> 15 ^ ctx ^ ctx >> 3) & ((s32)(1 << LZP_DICTIONARY) - 1);
+    while (in < in_end - min_match - 32 && out < out_eob) {
+        u32 idx = (ctx >> 15 ^ ctx ^ ctx >> 3) & mask;
         s32 val = lut[idx];
         lut[idx] = in - ins;
-        if (val > 0) {
-            const u8 * RESTRICT ref = ins + val;
-            if (memcmp(in + LZP_MIN_MATCH - 4, ref + LZP_MIN_MATCH - 4, sizeof(u32)) == 0 &&
+        if (val != 0) {
+            const u8 * RESTRICT ref = val > 0 ? ins + val : hist_end + val;
+            const u8 * lim = in_end - min_match - 32;
+            if (val < 0) {
+                // Matches in the history must not run past its end.
+                if (hist_end - ref < min_match + 4) goto not_found;
+                if (hist_end - ref - 4 < lim - in) lim = in + (hist_end - ref - 4);
+            }
+            if (memcmp(in + min_match - 4, ref + min_match - 4, sizeof(u32)) == 0 &&
                 memcmp(in, ref, sizeof(u32)) == 0) {
                 if (heur > in && lzp_upcast(heur) != lzp_upcast(ref + (heur - in))) goto not_found;
 
                 s32 len = 4;
-                for (; in + len < in_end - LZP_MIN_MATCH - 32; len += sizeof(u32)) {
+                for (; in + len < lim; len += sizeof(u32)) {
                     if (lzp_upcast(in + len) != lzp_upcast(ref + len)) break;
                 }
 
-                if (len < LZP_MIN_MATCH) {
+                if (len < min_match) {
                     if (heur < in + len) heur = in + len;
                     goto not_found;
                 }
 
-                len += in[len] == ref[len];
-                len += in[len] == ref[len];
-                len += in[len] == ref[len];
+                if (val > 0 || in + len < lim) {
+                    len += in[len] == ref[len];
+                    len += in[len] == ref[len];
+                    len += in[len] == ref[len];
+                }
 
                 in += len;
                 ctx = ((u32)in[-1]) | (((u32)in[-2]) << 8) | (((u32)in[-3]) << 16) | (((u32)in[-4]) << 24);
 
                 *out++ = MATCH;
 
-                len -= LZP_MIN_MATCH;
+                len -= min_match;
                 while (len >= 254) {
                     len -= 254;
                     *out++ = 254;
@@ -185,45 +227,47 @@ static s32 lzp_encode_block(const u8 * RESTRICT in, const u8 * in_end, u8 * REST
     ctx = ((u32)in[-1]) | (((u32)in[-2]) << 8) | (((u32)in[-3]) << 16) | (((u32)in[-4]) << 24);
 
     while (in < in_end && out < out_eob) {
-        u32 idx = (ctx >> 15 ^ ctx ^ ctx >> 3) & ((s32)(1 << LZP_DICTIONARY) - 1);
+        u32 idx = (ctx >> 15 ^ ctx ^ ctx >> 3) & mask;
         s32 val = lut[idx];
         lut[idx] = (s32)(in - ins);
 
         u8 next = *out++ = *in++;
         ctx = ctx << 8 | next;
-        if (next == MATCH && val > 0) *out++ = 255;
+        if (next == MATCH && val != 0) *out++ = 255;
     }
 
     return out >= out_eob ? -1 : (s32)(out - outs);
 }
 
-static s32 lzp_decode_block(const u8 * RESTRICT in, const u8 * in_end, s32 * RESTRICT lut, u8 * RESTRICT out,
-                            const u8 * out_end) {
+static s32 lzp_decode_block(const u8 * RESTRICT in, const u8 * in_end, s32 * RESTRICT lut, u32 mask,
+                            u8 * RESTRICT out, const u8 * out_end, s32 min_match, const u8 * hist_end, u32 * crc) {
     const u8 * outs = out;
+    u8 * crc_pos = out;
 
     for (s32 i = 0; i < 4; ++i) *out++ = *in++;
 
     u32 ctx = ((u32)out[-1]) | (((u32)out[-2]) << 8) | (((u32)out[-3]) << 16) | (((u32)out[-4]) << 24);
 
     while (in < in_end && out < out_end) {
-        u32 idx = (ctx >> 15 ^ ctx ^ ctx >> 3) & ((s32)(1 << LZP_DICTIONARY) - 1);
+        u32 idx = (ctx >> 15 ^ ctx ^ ctx >> 3) & mask;
         s32 val = lut[idx]; // SAFETY: guaranteed to be in-bounds by & mask. 
         lut[idx] = (s32)(out - outs);
-        if (*in == MATCH && val > 0) {
+        if (*in == MATCH && val != 0) {
             in++;
             // SAFETY: 'in' is advanced here, but it may have been at last index in the case of untrusted bad data.
             if (UNLIKELY(in == in_end)) return -1;
             if (*in != 255) {
-                s32 len = LZP_MIN_MATCH;
+                s32 len = min_match;
                 while (1) {
                     if (UNLIKELY(in == in_end)) return -1;
                     len += *in;
                     if (*in++ != 254) break;
                 }
 
-                const u8 * ref = outs + val;
+                const u8 * ref = val > 0 ? outs + val : hist_end + val;
                 const u8 * oe = out + len;
                 if (UNLIKELY(oe > out_end)) oe = out_end;
+                if (val < 0 && UNLIKELY(oe - out > hist_end - ref)) return -1;
 
                 while (out < oe) *out++ = *ref++;
 
@@ -235,25 +279,52 @@ static s32 lzp_decode_block(const u8 * RESTRICT in, const u8 * in_end, s32 * RES
         } else {
             ctx = (ctx << 8) | (*out++ = *in++);
         }
+
+        if (crc && out - crc_pos >= CRC_CHUNK) {
+            *crc = crc32sum(*crc, crc_pos, out - crc_pos);
+            crc_pos = out;
+        }
     }
 
+    if (crc) *crc = crc32sum(*crc, crc_pos, out - crc_pos);
+
     return out - outs;
 }
 
-static s32 lzp_compress(const u8 * RESTRICT in, u8 * RESTRICT out, s32 n, s32 * RESTRICT lut) {
-    if (n < LZP_MIN_MATCH + 32) return -1;
+/* Fill the lookup table with the positions in the history, as if it had just been encoded. */
+static void lzp_prime(s32 * RESTRICT lut, u32 mask, const u8 * hist, s32 n) {
+    if (n < 4) return;
+
+    u32 ctx = ((u32)hist[3]) | (((u32)hist[2]) << 8) | (((u32)hist[1]) << 16) | (((u32)hist[0]) << 24);
+
+    for (s32 i = 4; i < n; i++) {
+        u32 idx = (ctx >> 15 ^ ctx ^ ctx >> 3) & mask;
+        lut[idx] = i - n;
+        ctx = ctx << 8 | hist[i];
+    }
+}
+
+/* The lookup table has `1 << bits' entries. */
+static s32 lzp_compress(const u8 * RESTRICT in, u8 * RESTRICT out, s32 n, s32 * RESTRICT lut, s32 bits,
+                        s32 min_match, const u8 * hist, s32 hist_size) {
+    if (n < min_match + 32) return -1;
 
-    memset(lut, 0, sizeof(s32) * (1 << LZP_DICTIONARY));
+    memset(lut, 0, sizeof(s32) * (1 << bits));
+    lzp_prime(lut, (1u << bits) - 1, hist, hist_size);
 
-    return lzp_encode_block(in, in + n, out, out + n, lut);
+    return lzp_encode_block(in, in + n, out, out + n, lut, (1u << bits) - 1, min_match,
+                            hist ? hist + hist_size : NULL);
 }
 
-static s32 lzp_decompress(const u8 * RESTRICT in, u8 * RESTRICT out, s32 n, s32 max, s32 * RESTRICT lut) {
+static s32 lzp_decompress(const u8 * RESTRICT in, u8 * RESTRICT out, s32 n, s32 max, s32 * RESTRICT lut, s32 bits,
+                          s32 min_match, const u8 * hist, s32 hist_size, u32 * crc) {
     if (n < 4) return -1;
 
-    memset(lut, 0, sizeof(s32) * (1 << LZP_DICTIONARY));
+    memset(lut, 0, sizeof(s32) * (1 << bits));
+    lzp_prime(lut, (1u << bits) - 1, hist, hist_size);
 
-    return lzp_decode_block(in, in + n, lut, out, out + max);
+    return lzp_decode_block(in, in + n, lut, (1u << bits) - 1, out, out + max, min_match,
+                            hist ? hist + hist_size : NULL, crc);
 }
 
 /* RLE code. Unlike RLE in other compressors, we collapse all runs if they yield a net gain
@@ -261,20 +332,39 @@ static s32 lzp_decompress(const u8 * RESTRICT in, u8 * RESTRICT out, s32 n, s32
    performance and reduces the amount of collapsing done in normal blocks (so that BWT+AC can
    be more efficient) while we still filter out all the pathological data. */
 
-static s32 mrlec(u8 * in, s32 inlen, u8 * out) {
-    u8 * ip = in;
-    u8 * in_end = in + inlen;
-    s32 op = 0;
+/* Computes the gain of collapsing runs for every character into `t', which must be zeroed by the caller. The CRC of
+   the block is computed along the way, so that the encoder reads its input only once before RLE. Returns the
+   updated CRC. */
+static u32 mrlec_stats(const u8 * RESTRICT in, s32 inlen, u32 crc, s32 * RESTRICT t) {
     s32 c, pc = -1;
-    s32 t[256] = { 0 };
     s32 run = 0;
-    while ((c = (ip < in_end ? *ip++ : -1)) != -1) {
+    for (s32 i = 0; i < inlen; i++) {
+        c = in[i];
+        crc = crc32Table[((u8)crc ^ c) & 0xff] ^ (crc >> 8);
         if (c == pc)
             t[c] += (++run % 255) != 0;
         else
             --t[c], run = 0;
         pc = c;
     }
+    return crc;
+}
+
+/* Whether RLE could possibly pay off: if no character gains from collapsing its runs, RLE would only prepend the
+   32 byte table to the data. */
+static int mrlec_worthwhile(const s32 * t) {
+    for (s32 i = 0; i < 256; ++i)
+        if (t[i] > 0) return 1;
+    return 0;
+}
+
+/* Collapses the runs using the gain table computed by mrlec_stats. */
+static s32 mrlec(u8 * in, s32 inlen, u8 * out, const s32 * t) {
+    u8 * ip = in;
+    u8 * in_end = in + inlen;
+    s32 op = 0;
+    s32 c, pc = -1;
+    s32 run = 0;
     for (s32 i = 0; i < 32; ++i) {
         c = 0;
         for (s32 j = 0; j < 8; ++j) c += (t[i * 8 + j] > 0) << j;
@@ -300,8 +390,8 @@ static s32 mrlec(u8 * in, s32 inlen, u8 * out) {
     return op;
 }
 
-static int mrled(u8 * RESTRICT in, u8 * RESTRICT out, s32 outlen, s32 maxin) {
-    s32 op = 0, ip = 0;
+static int mrled(u8 * RESTRICT in, u8 * RESTRICT out, s32 outlen, s32 maxin, u32 * crc) {
+    s32 op = 0, ip = 0, crc_pos = 0;
 
     s32 c, pc = -1;
     s32 t[256] = { 0 };
@@ -323,41 +413,148 @@ static int mrled(u8 * RESTRICT in, u8 * RESTRICT out, s32 outlen, s32 maxin) {
             for (; run > 0 && op < outlen; --run) out[op++] = c;
         } else
             out[op++] = c;
+
+        if (crc && op - crc_pos >= CRC_CHUNK) {
+            *crc = crc32sum(*crc, out + crc_pos, op - crc_pos);
+            crc_pos = op;
+        }
     }
 
+    if (crc) *crc = crc32sum(*crc, out + crc_pos, op - crc_pos);
+
     return op != outlen;
 }
 
 /* The entropy coder. Uses an arithmetic coder implementation outlined in Matt Mahoney's DCE. */
 
+/* Coder variants, selected by the compression level and stored in bits 4 and 5 of the block model. The fast coder
+   drops the APM and codes with the counter mix alone. The strong coder adds a second APM, with the high bits of
+   the previous byte as context, and averages it with the first one. The rANS coder, further below, replaces this
+   one altogether. */
+#define CODER_CM 0
+#define CODER_FAST 1
+#define CODER_STRONG 2
+#define CODER_RANS 3
+
+#define model_coder(model) (((model) >> 4) & 3)
+
 typedef struct {
     /* Input/output. */
-    u8 *in_queue, *out_queue;
-    s32 input_ptr, output_ptr, input_max;
+    const u8 * in_queue;
+    u8 * out_queue;
+    s32 input_ptr, output_ptr, input_max, output_max;
 
     /* C0, C1 - used for making the initial prediction, C2 used for an APM with a slightly low
        learning rate (6) and 512 contexts. kanzi merges C0 and C1, uses slightly different
-       counter initialisation code and prediction code which from my tests tends to be suboptimal. */
+       counter initialisation code and prediction code which from my tests tends to be suboptimal.
+       C3 is the APM of the strong coder, only allocated once a block needs it, see strong_apm. */
     u16 C0[256], C1[256][256], C2[512][17];
+    u16 (*C3)[17];
+
+    /* The rows of C1 are only set up once the coder gets to the previous byte they belong to, which spares small
+       blocks most of the work of begin. `c1_ready' has a bit set for each row that is, `dict' is where they come
+       from. */
+    const struct bz3_dict * dict;
+    u64 c1_ready[4];
 } state;
 
+/* A dictionary: a history that LZP can refer to, and the model that the coder starts from instead of the one set up
+   by begin. The strong coder's APM always starts afresh. The history follows the structure in memory. */
+struct bz3_dict {
+    u32 id;
+    s32 history_size;
+    const u8 * history;
+    u16 C0[256], C1[256][256], C2[512][17];
+};
+
 #define write_out(s, c) (s)->out_queue[(s)->output_ptr++] = (c)
 #define read_in(s) ((s)->input_ptr < (s)->input_max ? (s)->in_queue[(s)->input_ptr++] : -1)
 
 #define update0(p, x) (p) = ((p) - ((p) >> x))
 #define update1(p, x) (p) = ((p) + (((p) ^ 65535) >> x))
 
-static void begin(state * s) {
+static void cm_row(state * s, u32 c1) {
+    if (s->dict)
+        memcpy(s->C1[c1], s->dict->C1[c1], sizeof(s->C1[c1]));
+    else
+        for (int j = 0; j < 256; j++) s->C1[c1][j] = 1 << 15;
+    s->c1_ready[c1 >> 6] |= (u64)1 << (c1 & 63);
+}
+
+static ALWAYS_INLINE void cm_need_row(state * s, u32 c1) {
+    if (UNLIKELY(!(s->c1_ready[c1 >> 6] >> (c1 & 63) & 1))) cm_row(s, c1);
+}
+
+/* Sets up the rows of C1 that the coder didn't need, for when the whole model is read. */
+static void cm_all_rows(state * s) {
+    for (u32 c1 = 0; c1 < 256; c1++) cm_need_row(s, c1);
+}
+
+static void begin(state * s, int coder, const struct bz3_dict * dict) {
+    u16 apm[17];
+    for (int k = 0; k < 17; k++) apm[k] = (k << 12) - (k == 16);  // Firm difference from stdpack.
+
     prefetch(s);
-    for (int i = 0; i < 256; i++) s->C0[i] = 1 << 15;
-    for (int i = 0; i < 256; i++)
-        for (int j = 0; j < 256; j++) s->C1[i][j] = 1 << 15;
-    for (int i = 0; i < 2; i++)
-        for (int j = 0; j < 256; j++)
-            for (int k = 0; k < 17; k++) s->C2[2 * j + i][k] = (k << 12) - (k == 16);  // Firm difference from stdpack.
+    s->dict = dict;
+    memset(s->c1_ready, 0, sizeof(s->c1_ready));
+    // Both coding loops start with the previous bytes set to 0.
+    cm_row(s, 0);
+    if (dict) {
+        memcpy(s->C0, dict->C0, sizeof(s->C0));
+        memcpy(s->C2, dict->C2, sizeof(s->C2));
+    } else {
+        for (int i = 0; i < 256; i++) s->C0[i] = 1 << 15;
+        for (int i = 0; i < 512; i++) memcpy(s->C2[i], apm, sizeof(apm));
+    }
+    if (coder == CODER_STRONG)
+        for (int j = 0; j < 8192; j++) memcpy(s->C3[j], apm, sizeof(apm));
+}
+
+/* Probability, scaled to 18 bits, that the next bit of the partial byte `ctx' is set. `j' receives the APM bucket
+   to be updated by `cm_update'. Always inlined, so that every coder gets its own copy of the coding loops. */
+static ALWAYS_INLINE u32 cm_predict(state * s, const int coder, u32 c1, u32 c2, int ctx, int f, int * j) {
+    const int p0 = s->C0[ctx];
+    const int p1 = s->C1[c1][ctx];
+    const int p2 = s->C1[c2][ctx];
+    const int p = ((p0 + p1) * 7 + p2 + p2) >> 4;
+
+    if (coder == CODER_FAST) return p << 2;
+
+    *j = p >> 12;
+    const int x1 = s->C2[2 * ctx + f][*j];
+    const int x2 = s->C2[2 * ctx + f][*j + 1];
+    const int ssep = x1 + (((x2 - x1) * (p & 4095)) >> 12);
+
+    if (coder == CODER_CM) return ssep * 3 + p;
+
+    const int y1 = s->C3[(c1 >> 3) << 8 | ctx][*j];
+    const int y2 = s->C3[(c1 >> 3) << 8 | ctx][*j + 1];
+    return ssep * 2 + y1 + (((y2 - y1) * (p & 4095)) >> 12) + p;
+}
+
+static ALWAYS_INLINE void cm_update(state * s, const int coder, u32 c1, int ctx, int f, int j, int bit) {
+    if (bit) {
+        update1(s->C0[ctx], 2);
+        update1(s->C1[c1][ctx], 4);
+        if (coder == CODER_FAST) return;
+        update1(s->C2[2 * ctx + f][j], 6);
+        update1(s->C2[2 * ctx + f][j + 1], 6);
+        if (coder == CODER_CM) return;
+        update1(s->C3[(c1 >> 3) << 8 | ctx][j], 6);
+        update1(s->C3[(c1 >> 3) << 8 | ctx][j + 1], 6);
+    } else {
+        update0(s->C0[ctx], 2);
+        update0(s->C1[c1][ctx], 4);
+        if (coder == CODER_FAST) return;
+        update0(s->C2[2 * ctx + f][j], 6);
+        update0(s->C2[2 * ctx + f][j + 1], 6);
+        if (coder == CODER_CM) return;
+        update0(s->C3[(c1 >> 3) << 8 | ctx][j], 6);
+        update0(s->C3[(c1 >> 3) << 8 | ctx][j + 1], 6);
+    }
 }
 
-static void encode_bytes(state * s, u8 * buf, s32 size) {
+static ALWAYS_INLINE int encode_bytes_with(state * s, u8 * buf, s32 size, const int coder) {
     /* Arithmetic coding, detecting runs of characters in the file */
     u32 high = 0xFFFFFFFF, low = 0, c1 = 0, c2 = 0, run = 0;
 
@@ -374,52 +571,35 @@ static void encode_bytes(state * s, u8 * buf, s32 size) {
         int ctx = 1;
 
         while (ctx < 256) {
-            const int p0 = s->C0[ctx];
-            const int p1 = s->C1[c1][ctx];
-            const int p2 = s->C1[c2][ctx];
-            const int p = ((p0 + p1) * 7 + p2 + p2) >> 4;
-
-            const int j = p >> 12;
-            const int x1 = s->C2[2 * ctx + f][j];
-            const int x2 = s->C2[2 * ctx + f][j + 1];
-            const int ssep = x1 + (((x2 - x1) * (p & 4095)) >> 12);
-
-            if (c & 128) {
-                high = low + (((u64)(high - low) * (ssep * 3 + p)) >> 18);
-
-                while ((low ^ high) < (1 << 24)) {
-                    write_out(s, low >> 24);
-                    low <<= 8;
-                    high = (high << 8) + 0xFF;
-                }
-
-                update1(s->C0[ctx], 2);
-                update1(s->C1[c1][ctx], 4);
-                update1(s->C2[2 * ctx + f][j], 6);
-                update1(s->C2[2 * ctx + f][j + 1], 6);
-                ctx += ctx + 1;
-            } else {
-                low += (((u64)(high - low) * (ssep * 3 + p)) >> 18) + 1;
+            int j = 0;
+            const u32 p = cm_predict(s, coder, c1, c2, ctx, f, &j);
+            const int bit = c >> 7;
 
-                // Write identical bits.
-                while ((low ^ high) < (1 << 24)) {
-                    write_out(s, low >> 24);  // Same as high >> 24
-                    low <<= 8;
-                    high = (high << 8) + 0xFF;
-                }
+            if (bit)
+                high = low + (((u64)(high - low) * p) >> 18);
+            else
+                low += (((u64)(high - low) * p) >> 18) + 1;
 
-                update0(s->C0[ctx], 2);
-                update0(s->C1[c1][ctx], 4);
-                update0(s->C2[2 * ctx + f][j], 6);
-                update0(s->C2[2 * ctx + f][j + 1], 6);
-                ctx += ctx;
+            // Write identical bits.
+            while ((low ^ high) < (1 << 24)) {
+                write_out(s, low >> 24);  // Same as high >> 24
+                low <<= 8;
+                high = (high << 8) + 0xFF;
             }
 
+            cm_update(s, coder, c1, ctx, f, j, bit);
+            ctx += ctx + bit;
+
             c <<= 1;
         }
 
         c2 = c1;
         c1 = ctx & 255;
+        cm_need_row(s, c1);
+
+        // Without the usual APM, the other coders can't be trusted not to expand incompressible data past
+        // `bz3_bound()'. Give up once past `output_max', leaving some room for the current byte.
+        if (coder != CODER_CM && UNLIKELY(s->output_ptr > s->output_max)) return -1;
     }
 
     write_out(s, low >> 24);
@@ -430,9 +610,10 @@ static void encode_bytes(state * s, u8 * buf, s32 size) {
     low <<= 8;
     write_out(s, low >> 24);
     low <<= 8;
+    return 0;
 }
 
-static void decode_bytes(state * s, u8 * c, s32 size) {
+static ALWAYS_INLINE void decode_bytes_with(state * s, u8 * c, s32 size, s32 * RESTRICT freq, const int coder) {
     u32 high = 0xFFFFFFFF, low = 0, c1 = 0, c2 = 0, run = 0, code = 0;
 
     code = (code << 8) + read_in(s);
@@ -451,17 +632,10 @@ static void decode_bytes(state * s, u8 * c, s32 size) {
         int ctx = 1;
 
         while (ctx < 256) {
-            const int p0 = s->C0[ctx];
-            const int p1 = s->C1[c1][ctx];
-            const int p2 = s->C1[c2][ctx];
-            const int p = ((p0 + p1) * 7 + p2 + p2) >> 4;
+            int j = 0;
+            const u32 p = cm_predict(s, coder, c1, c2, ctx, f, &j);
 
-            const int j = p >> 12;
-            const int x1 = s->C2[2 * ctx + f][j];
-            const int x2 = s->C2[2 * ctx + f][j + 1];
-            const int ssep = x1 + (((x2 - x1) * (p & 4095)) >> 12);
-
-            const u32 mid = low + (((u64)(high - low) * (ssep * 3 + p)) >> 18);
+            const u32 mid = low + (((u64)(high - low) * p) >> 18);
             const u8 bit = code <= mid;
             if (bit)
                 high = mid;
@@ -473,24 +647,394 @@ static void decode_bytes(state * s, u8 * c, s32 size) {
                 code = (code << 8) + read_in(s);
             }
 
-            if (bit) {
-                update1(s->C0[ctx], 2);
-                update1(s->C1[c1][ctx], 4);
-                update1(s->C2[2 * ctx + f][j], 6);
-                update1(s->C2[2 * ctx + f][j + 1], 6);
-                ctx += ctx + 1;
-            } else {
-                update0(s->C0[ctx], 2);
-                update0(s->C1[c1][ctx], 4);
-                update0(s->C2[2 * ctx + f][j], 6);
-                update0(s->C2[2 * ctx + f][j + 1], 6);
-                ctx += ctx;
-            }
+            cm_update(s, coder, c1, ctx, f, j, bit);
+            ctx += ctx + bit;
         }
 
         c2 = c1;
         c[i] = c1 = ctx & 255;
+        freq[c1]++;
+        cm_need_row(s, c1);
+    }
+}
+
+/* Returns -1 if a coder other than the default one outputs more than `output_max' bytes. */
+static int encode_bytes(state * s, u8 * buf, s32 size, int coder) {
+    switch (coder) {
+        case CODER_FAST: return encode_bytes_with(s, buf, size, CODER_FAST);
+        case CODER_STRONG: return encode_bytes_with(s, buf, size, CODER_STRONG);
+        default: return encode_bytes_with(s, buf, size, CODER_CM);
+    }
+}
+
+/* Also counts the decoded symbols into `freq', which must be zeroed by the caller. */
+static void decode_bytes(state * s, u8 * c, s32 size, s32 * RESTRICT freq, int coder) {
+    switch (coder) {
+        case CODER_FAST: decode_bytes_with(s, c, size, freq, CODER_FAST); break;
+        case CODER_STRONG: decode_bytes_with(s, c, size, freq, CODER_STRONG); break;
+        default: decode_bytes_with(s, c, size, freq, CODER_CM); break;
+    }
+}
+
+/* The rANS coder, an alternative to the one above for the fastest compression level. The BWT output goes through
+   the move-to-front transform and then gets coded in chunks of RANS_CHUNK bytes, each with its own frequency
+   tables for three contexts: the previous MTF index being 0, 1 or anything else. Decoding takes a table lookup
+   per byte instead of eight binary decisions, and four interleaved states keep the lookups from waiting on each
+   other. Chunks that don't shrink are stored as they are. Based on Fabian Giesen's rans_byte.h (public domain). */
+
+#define RANS_CHUNK KiB(256)
+#define RANS_SCALE_BITS 12
+#define RANS_SCALE (1 << RANS_SCALE_BITS)
+#define RANS_L (1u << 23)
+#define RANS_CONTEXTS 3
+
+#define rans_ctx(prev) ((prev) < 2 ? (prev) : 2)
+
+static void mtf_encode(u8 * buf, s32 size) {
+    u8 order[256];
+    for (int i = 0; i < 256; i++) order[i] = i;
+    for (s32 i = 0; i < size; i++) {
+        const u8 c = buf[i];
+        int j = 0;
+        while (order[j] != c) j++;
+        memmove(order + 1, order, j);
+        order[0] = c;
+        buf[i] = j;
+    }
+}
+
+/* Scale the counts to add up to RANS_SCALE, keeping every symbol that occurs. */
+static void rans_normalize(const u32 * count, u32 total, u16 * freq) {
+    s32 sum = 0, max = 0;
+    for (int i = 0; i < 256; i++) {
+        freq[i] = 0;
+        if (!count[i]) continue;
+        freq[i] = (u64)count[i] * RANS_SCALE / total;
+        if (!freq[i]) freq[i] = 1;
+        sum += freq[i];
+        if (freq[i] > freq[max]) max = i;
+    }
+    if (!total) return;
+    // Rounding down leaves the sum short, while keeping rare symbols at 1 may push it over.
+    if (sum < RANS_SCALE) freq[max] += RANS_SCALE - sum;
+    while (sum > RANS_SCALE)
+        for (int i = 0; i < 256 && sum > RANS_SCALE; i++)
+            if (freq[i] > 1) freq[i]--, sum--;
+}
+
+/* Code `size' MTF indices from `in' into `out'. `tmp' must have room for 2 * min(size, RANS_CHUNK) + 32 bytes.
+   Returns the amount of bytes written, at most size + size / RANS_CHUNK + 1. */
+static s32 rans_encode(const u8 * RESTRICT in, s32 size, u8 * RESTRICT out, u8 * RESTRICT tmp) {
+    u8 * o = out;
+
+    for (s32 start = 0; start < size; start += RANS_CHUNK) {
+        const u8 * c = in + start;
+        const s32 n = size - start < RANS_CHUNK ? size - start : RANS_CHUNK;
+        u32 count[RANS_CONTEXTS][256] = { { 0 } }, total[RANS_CONTEXTS] = { 0 };
+        u16 freq[RANS_CONTEXTS][256], cum[RANS_CONTEXTS][256];
+
+        for (s32 i = 0, prev = 0; i < n; prev = c[i++]) {
+            count[rans_ctx(prev)][c[i]]++;
+            total[rans_ctx(prev)]++;
+        }
+
+        // The tables: the amount of symbols, then each symbol with its frequency in one or two bytes.
+        u8 * p = o + 1;
+        for (int k = 0; k < RANS_CONTEXTS; k++) {
+            rans_normalize(count[k], total[k], freq[k]);
+            u8 * nsym = p;
+            p += 2;
+            s32 sym = 0;
+            for (int i = 0, f = 0; i < 256; f += freq[k][i++]) {
+                cum[k][i] = f;
+                if (!freq[k][i]) continue;
+                *p++ = i;
+                if (freq[k][i] >= 128) *p++ = 0x80 | freq[k][i] >> 8;
+                *p++ = freq[k][i] & (freq[k][i] >= 128 ? 255 : 127);
+                sym++;
+            }
+            nsym[0] = sym & 255;
+            nsym[1] = sym >> 8;
+        }
+
+        // The stream is written backwards, so that the decoder can read it forwards.
+        u8 * end = tmp + 2 * n + 32, * ptr = end;
+        u32 x[4] = { RANS_L, RANS_L, RANS_L, RANS_L };
+        for (s32 i = n - 1; i >= 0; i--) {
+            const int k = rans_ctx(i ? c[i - 1] : 0);
+            const u32 f = freq[k][c[i]], x_max = ((RANS_L >> RANS_SCALE_BITS) << 8) * f;
+            u32 s = x[i & 3];
+            while (s >= x_max) {
+                *--ptr = s & 255;
+                s >>= 8;
+            }
+            x[i & 3] = ((s / f) << RANS_SCALE_BITS) + (s % f) + cum[k][c[i]];
+        }
+        for (int j = 3; j >= 0; j--) {
+            ptr -= 4;
+            write_neutral_s32(ptr, x[j]);
+        }
+
+        if ((p - o) + (end - ptr) < n + 1) {
+            *o = 1;
+            memcpy(p, ptr, end - ptr);
+            o = p + (end - ptr);
+        } else {
+            *o++ = 0;
+            memcpy(o, c, n);
+            o += n;
+        }
+    }
+
+    return o - out;
+}
+
+/* Decode `size' bytes from the `in_size' bytes at `in' into `out', undoing the MTF transform. Also counts the
+   decoded symbols into `freq', which must be zeroed by the caller. Returns -1 if the input is malformed. */
+static int rans_decode(const u8 * RESTRICT in, s32 in_size, u8 * RESTRICT out, s32 size, s32 * RESTRICT freq) {
+    const u8 * in_end = in + in_size;
+    u8 order[256];
+    for (int i = 0; i < 256; i++) order[i] = i;
+
+    for (s32 start = 0; start < size; start += RANS_CHUNK) {
+        u8 * o = out + start;
+        const s32 n = size - start < RANS_CHUNK ? size - start : RANS_CHUNK;
+
+        if (in == in_end) return -1;
+        const u8 kind = *in++;
+
+        if (kind == 0) {
+            if (in_end - in < n) return -1;
+            for (s32 i = 0; i < n; i++) {
+                const u8 m = in[i], c = order[m];
+                memmove(order + 1, order, m);
+                order[0] = c;
+                o[i] = c;
+                freq[c]++;
+            }
+            in += n;
+            continue;
+        }
+
+        if (kind != 1) return -1;
+
+        u16 fr[RANS_CONTEXTS][256], cum[RANS_CONTEXTS][256];
+        u8 sym[RANS_CONTEXTS][RANS_SCALE];
+        for (int k = 0; k < RANS_CONTEXTS; k++) {
+            if (in_end - in < 2) return -1;
+            const s32 nsym = in[0] | in[1] << 8;
+            in += 2;
+            if (nsym > 256) return -1;
+            memset(fr[k], 0, sizeof(fr[k]));
+            s32 total = 0;
+            for (s32 i = 0; i < nsym; i++) {
+                if (in_end - in < 2) return -1;
+                const u8 s = *in++;
+                u32 f = *in++;
+                if (f & 0x80) {
+                    if (in == in_end) return -1;
+                    f = (f & 0x7f) << 8 | *in++;
+                }
+                if (!f || fr[k][s] || total + f > RANS_SCALE) return -1;
+                fr[k][s] = f;
+                cum[k][s] = total;
+                memset(sym[k] + total, s, f);
+                total += f;
+            }
+            if (!nsym) memset(sym[k], 0, sizeof(sym[k]));
+            else if (total != RANS_SCALE) return -1;
+        }
+
+        if (in_end - in < 16) return -1;
+        u32 x[4];
+        for (int j = 0; j < 4; j++) x[j] = read_neutral_s32(in + 4 * j);
+        in += 16;
+
+        for (s32 i = 0, prev = 0; i < n; i++) {
+            const int k = rans_ctx(prev);
+            u32 s = x[i & 3];
+            const u32 slot = s & (RANS_SCALE - 1);
+            const u8 m = sym[k][slot];
+            // Only possible in a context with no symbols, which the encoder never reaches.
+            if (UNLIKELY(!fr[k][m])) return -1;
+            s = fr[k][m] * (s >> RANS_SCALE_BITS) + slot - cum[k][m];
+            while (s < RANS_L) {
+                if (UNLIKELY(in == in_end)) return -1;
+                s = s << 8 | *in++;
+            }
+            x[i & 3] = s;
+
+            const u8 c = order[m];
+            memmove(order + 1, order, m);
+            order[0] = c;
+            o[i] = c;
+            freq[c]++;
+            prev = m;
+        }
+    }
+
+    return 0;
+}
+
+/* Low-memory inverse BWT. Instead of the 4n byte array used by libsais, the LF mapping is computed on the fly
+   from an occurrence table sampled every 1KiB of the BWT string. The counts are stored as 16-bit offsets from
+   the totals sampled every 64KiB, so the structure takes about n/2 bytes. The rank of a symbol is recovered
+   by counting it in the nearest 512 bytes of the BWT string, which makes this noticeably slower than libsais,
+   but lets huge blocks be decoded on machines that couldn't otherwise afford it. */
+
+#define OCC_BLOCK_BITS 10
+#define OCC_SUPER_BITS 16
+
+/* occ_build samples up to the end of the block of the BWT string that holds its last symbol. */
+#define occ_samples(n, bits) ((((n) + (1 << OCC_BLOCK_BITS) - 1) >> (bits)) + 1)
+
+static size_t occ_blocks_size(size_t n) { return occ_samples(n, OCC_BLOCK_BITS) * 256 * sizeof(u16); }
+
+static size_t occ_super_size(size_t n) { return occ_samples(n, OCC_SUPER_BITS) * 256 * sizeof(u32); }
+
+static u32 occ_count(const u8 * p, s32 len, u8 c) {
+    const u64 ones = 0x0101010101010101ULL, low7 = 0x7F7F7F7F7F7F7F7FULL, even = 0x00FF00FF00FF00FFULL;
+    const u64 pattern = ones * c;
+    u64 acc = 0;
+    u32 n;
+
+    /* Every matching byte sets the low bit of its lane. Less than 128 words are ever scanned,
+       so the per-lane sums can't overflow before the final horizontal add. */
+    for (; len >= 8; len -= 8, p += 8) {
+        u64 x;
+        memcpy(&x, p, sizeof(x));
+        x ^= pattern;
+        acc += (~(((x & low7) + low7) | x | low7)) >> 7;
     }
+    acc = (acc & even) + ((acc >> 8) & even);
+    n = (u32)((acc * 0x0001000100010001ULL) >> 48);
+    while (len--) n += *p++ == c;
+    return n;
+}
+
+static void occ_build(const u8 * RESTRICT L, s32 n, u32 * RESTRICT sup, u16 * RESTRICT blk, u32 * RESTRICT C) {
+    u32 cnt[256] = { 0 };
+
+    for (s32 i = 0;; i += 1 << OCC_BLOCK_BITS) {
+        u32 * s = sup + (size_t)(i >> OCC_SUPER_BITS) * 256;
+        u16 * b = blk + (size_t)(i >> OCC_BLOCK_BITS) * 256;
+        if (!(i & ((1 << OCC_SUPER_BITS) - 1))) memcpy(s, cnt, sizeof(cnt));
+        for (s32 c = 0; c < 256; c++) b[c] = cnt[c] - s[c];
+        if (i >= n) break;
+        s32 end = n - i < (1 << OCC_BLOCK_BITS) ? n : i + (1 << OCC_BLOCK_BITS);
+        for (s32 j = i; j < end; j++) cnt[L[j]]++;
+    }
+
+    // C[c] is the first row starting with c. Row 0 is taken by the implicit sentinel.
+    for (s32 c = 0, sum = 1; c < 256; c++) {
+        C[c] = sum;
+        sum += cnt[c];
+    }
+}
+
+static u32 occ_rank(const u8 * L, s32 n, const u32 * sup, const u16 * blk, u8 c, s32 u) {
+    s32 lo = u & ~((1 << OCC_BLOCK_BITS) - 1), hi = lo + (1 << OCC_BLOCK_BITS);
+    if (u - lo > (1 << (OCC_BLOCK_BITS - 1)) && hi <= n)
+        return sup[(size_t)(hi >> OCC_SUPER_BITS) * 256 + c] + blk[(size_t)(hi >> OCC_BLOCK_BITS) * 256 + c] -
+               occ_count(L + u, hi - u, c);
+    return sup[(size_t)(lo >> OCC_SUPER_BITS) * 256 + c] + blk[(size_t)(lo >> OCC_BLOCK_BITS) * 256 + c] +
+           occ_count(L + lo, u - lo, c);
+}
+
+/* Same contract as libsais_unbwt: `L' is the BWT string without the sentinel, `idx' the primary index. */
+static s32 occ_unbwt(const u8 * RESTRICT L, u8 * RESTRICT out, u32 * RESTRICT sup, u16 * RESTRICT blk, s32 n,
+                     s32 idx) {
+    u32 C[256];
+
+    if (idx <= 0 || idx > n) return -1;
+
+    occ_build(L, n, sup, blk, C);
+
+    // Walk the LF mapping backwards from the sentinel row, skipping the sentinel's position in `L'.
+    u32 j = 0;
+    for (s32 k = n - 1; k >= 0; k--) {
+        s32 u = j - (j > (u32)idx);
+        u8 c = L[u];
+        out[k] = c;
+        j = C[c] + occ_rank(L, n, sup, blk, c, u);
+        // SAFETY: in a well-formed BWT, the sentinel row is only reached after the last symbol.
+        if (UNLIKELY(j == (u32)idx && k)) return -1;
+    }
+
+    return 0;
+}
+
+/* Small blocks are inverted by walking a plain LF table, which fits in the cache: setting up the tables libsais
+   works with costs more than the whole walk below this size. Same contract as libsais_unbwt; `out' may alias `L'. */
+
+#define SMALL_UNBWT KiB(64)
+
+static s32 small_unbwt(const u8 * L, u8 * out, u32 * RESTRICT lf, s32 n, const s32 * freq, s32 idx) {
+    u32 C[256];
+
+    if (idx <= 0 || idx > n) return -1;
+
+    for (s32 c = 0, sum = 1; c < 256; c++) {
+        C[c] = sum;
+        sum += freq[c];
+    }
+
+    // Each entry holds the row preceding it in the LF mapping along with its symbol.
+    for (s32 i = 0; i < n; i++) lf[i] = C[L[i]]++ << 8 | L[i];
+
+    u32 j = 0;
+    for (s32 k = n - 1; k >= 0; k--) {
+        u32 e = lf[j - (j > (u32)idx)];
+        out[k] = (u8)e;
+        j = e >> 8;
+        if (UNLIKELY(j == (u32)idx && k)) return -1;
+    }
+
+    return 0;
+}
+
+/* Allocation of the block sized buffers. Both suffix sorting and the inverse BWT access them at random, so with
+   4KiB pages most of these accesses miss the TLB. With BZ3_FLAG_HUGETLB on Linux, the pages are taken from the
+   hugetlbfs pool if it has enough of them; otherwise, the buffers are aligned to 2MiB and marked with MADV_HUGEPAGE,
+   so that they are backed by transparent huge pages even if the system only enables them on request. This is opt-in
+   until it is shown to pay off: see etc/BENCHMARKS.md. */
+
+#define HUGE_PAGE_SIZE MiB(2)
+
+static void * alloc_large(size_t size, s32 flags, size_t * mapped) {
+    *mapped = 0;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    size_t length = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    #if defined(MAP_HUGETLB)
+    if (flags & BZ3_FLAG_HUGETLB) {
+        void * p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *mapped = length;
+            return p;
+        }
+    }
+    #endif
+    if ((flags & BZ3_FLAG_HUGETLB) && size >= HUGE_PAGE_SIZE) {
+        void * p;
+        if (posix_memalign(&p, HUGE_PAGE_SIZE, length)) return NULL;
+        // Only a hint; the buffer works just as well if the kernel doesn't follow it.
+        madvise(p, length, MADV_HUGEPAGE);
+        return p;
+    }
+#endif
+    (void)flags;
+    return malloc(size);
+}
+
+static void free_large(void * ptr, size_t mapped) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE) && defined(MAP_HUGETLB)
+    if (mapped) {
+        munmap(ptr, mapped);
+        return;
+    }
+#endif
+    (void)mapped;
+    free(ptr);
 }
 
 /* Public API. */
@@ -499,15 +1043,78 @@ struct bz3_state {
     u8 * swap_buffer;
     s32 block_size;
     s32 *sais_array, *lzp_lut;
+    u32 * occ_super;
+    u16 * occ_blocks;
     state * cm_state;
+    s32 flags, level;
+    // Size of the LZP lookup table, see lzp_bits.
+    s32 lzp_bits;
+    const struct bz3_dict * dict;
     s8 last_error;
+
+    // Length of the mapping backing each large buffer taken from the hugetlbfs pool, 0 if allocated otherwise.
+    size_t swap_mapped, sais_mapped, occ_super_mapped, occ_blocks_mapped;
+
+    // The allocator the state and its buffers come from. If `alloc' is NULL, the block sized buffers come from
+    // alloc_large and everything else from malloc.
+    struct bz3_allocator allocator;
+};
+
+static void * state_alloc(struct bz3_state * state, size_t size, int large, size_t * mapped) {
+    if (mapped) *mapped = 0;
+    if (state->allocator.alloc) return state->allocator.alloc(state->allocator.opaque, size);
+    return large ? alloc_large(size, state->flags, mapped) : malloc(size);
+}
+
+static void state_free(struct bz3_state * state, void * ptr, size_t mapped) {
+    if (!ptr) return;
+    if (state->allocator.alloc)
+        state->allocator.free(state->allocator.opaque, ptr);
+    else
+        free_large(ptr, mapped);
+}
+
+/* A caller-provided workspace is handed out by a bump allocator, which keeps its cursor at the start of the
+   workspace itself. Everything is aligned to a cache line. */
+
+#define WORKSPACE_ALIGN 64
+#define workspace_round(x) (((size_t)(x) + WORKSPACE_ALIGN - 1) & ~(size_t)(WORKSPACE_ALIGN - 1))
+
+struct workspace {
+    u8 *next, *end;
 };
 
+static void * workspace_alloc(void * opaque, size_t size) {
+    struct workspace * ws = opaque;
+    if ((size_t)(ws->end - ws->next) < size) return NULL;
+    void * ptr = ws->next;
+    ws->next = (size_t)(ws->end - ws->next) < workspace_round(size) ? ws->end : ws->next + workspace_round(size);
+    return ptr;
+}
+
+static void workspace_free(void * opaque, void * ptr) {
+    (void)opaque;
+    (void)ptr;
+}
+
+/* The APM of the strong coder is bigger than the rest of the model. Only levels 7 to 9 use it, so it is set aside
+   the first time the state encodes or decodes a block with that coder, unless the caller gave an allocator: such
+   states get it upfront, as they must not allocate once created. */
+#define STRONG_APM_SIZE (8192 * 17 * sizeof(u16))
+
+static int strong_apm(struct bz3_state * state) {
+    if (!state->cm_state->C3) state->cm_state->C3 = state_alloc(state, STRONG_APM_SIZE, 0, NULL);
+    if (state->cm_state->C3) return 1;
+    state->last_error = BZ3_ERR_INIT;
+    return 0;
+}
+
 BZIP3_API s8 bz3_last_error(struct bz3_state * state) { return state->last_error; }
 
 BZIP3_API const char * bz3_version(void) { return VERSION; }
 
-BZIP3_API size_t bz3_bound(size_t input_size) { return input_size + input_size / 50 + 32; }
+// The slack covers the frame and block headers of a single block frame, dictionary id included.
+BZIP3_API size_t bz3_bound(size_t input_size) { return input_size + input_size / 50 + 36; }
 
 BZIP3_API const char * bz3_strerror(struct bz3_state * state) {
     switch (state->last_error) {
@@ -527,52 +1134,149 @@ BZIP3_API const char * bz3_strerror(struct bz3_state * state) {
             return "Too much data";
         case BZ3_ERR_DATA_SIZE_TOO_SMALL:
             return "Size of buffer `buffer_size` passed to the block decoder (bz3_decode_block) is too small. See function docs for details.";
+        case BZ3_ERR_UNSUPPORTED:
+            return "Operation not supported by this state";
+        case BZ3_ERR_DICTIONARY:
+            return "Wrong or missing dictionary";
+        case BZ3_ERR_CANCELED:
+            return "Job canceled";
         default:
             return "Unknown error";
     }
 }
 
-BZIP3_API struct bz3_state * bz3_new(s32 block_size) {
-    if (block_size < KiB(65) || block_size > MiB(511)) {
+BZIP3_API struct bz3_state * bz3_new_ex(s32 block_size, s32 flags, const struct bz3_allocator * allocator) {
+    if (block_size < 1 || block_size > MiB(511)) {
         return NULL;
     }
 
-    struct bz3_state * bz3_state = malloc(sizeof(struct bz3_state));
+    struct bz3_state * bz3_state =
+        allocator ? allocator->alloc(allocator->opaque, sizeof(struct bz3_state)) : malloc(sizeof(struct bz3_state));
 
     if (!bz3_state) {
         return NULL;
     }
 
-    bz3_state->cm_state = malloc(sizeof(state));
+    if (allocator)
+        bz3_state->allocator = *allocator;
+    else
+        bz3_state->allocator.alloc = NULL;
+
+    // The low memory decoder needs the swap buffer to hold the BWT output.
+    if (flags & BZ3_FLAG_LOW_MEMORY) flags &= ~BZ3_FLAG_IN_PLACE;
+
+    bz3_state->block_size = block_size;
+    bz3_state->flags = flags;
+    bz3_state->level = BZ3_LEVEL_DEFAULT;
+    bz3_state->dict = NULL;
+    bz3_state->lzp_bits = lzp_state_bits(block_size);
+
+    bz3_state->cm_state = state_alloc(bz3_state, sizeof(state), 0, NULL);
+    if (bz3_state->cm_state) {
+        bz3_state->cm_state->C3 = NULL;
+        if (allocator) strong_apm(bz3_state);
+    }
 
-    bz3_state->swap_buffer = malloc(bz3_bound(block_size));
-    bz3_state->sais_array = malloc(BWT_BOUND(block_size) * sizeof(s32));
-    memset(bz3_state->sais_array, 0, sizeof(s32) * BWT_BOUND(block_size));
+    bz3_state->swap_buffer = NULL;
+    bz3_state->sais_array = NULL;
+    bz3_state->occ_super = NULL;
+    bz3_state->occ_blocks = NULL;
+    bz3_state->swap_mapped = bz3_state->sais_mapped = 0;
+    bz3_state->occ_super_mapped = bz3_state->occ_blocks_mapped = 0;
+
+    if (!(flags & BZ3_FLAG_IN_PLACE))
+        bz3_state->swap_buffer = state_alloc(bz3_state, bz3_bound(block_size), 1, &bz3_state->swap_mapped);
+
+    if (flags & BZ3_FLAG_LOW_MEMORY) {
+        bz3_state->occ_super =
+            state_alloc(bz3_state, occ_super_size(bz3_bound(block_size)), 1, &bz3_state->occ_super_mapped);
+        bz3_state->occ_blocks =
+            state_alloc(bz3_state, occ_blocks_size(bz3_bound(block_size)), 1, &bz3_state->occ_blocks_mapped);
+    } else {
+        bz3_state->sais_array =
+            state_alloc(bz3_state, BWT_BOUND(block_size) * sizeof(s32), 1, &bz3_state->sais_mapped);
+    }
 
-    bz3_state->lzp_lut = calloc(1 << LZP_DICTIONARY, sizeof(s32));
+    // Cleared before every use by lzp_compress and lzp_decompress.
+    bz3_state->lzp_lut = state_alloc(bz3_state, (1 << bz3_state->lzp_bits) * sizeof(s32), 0, NULL);
 
-    if (!bz3_state->cm_state || !bz3_state->swap_buffer || !bz3_state->sais_array || !bz3_state->lzp_lut) {
-        if (bz3_state->cm_state) free(bz3_state->cm_state);
-        if (bz3_state->swap_buffer) free(bz3_state->swap_buffer);
-        if (bz3_state->sais_array) free(bz3_state->sais_array);
-        if (bz3_state->lzp_lut) free(bz3_state->lzp_lut);
-        free(bz3_state);
+    if (!bz3_state->cm_state || (allocator && !bz3_state->cm_state->C3) || (!bz3_state->swap_buffer && !(flags & BZ3_FLAG_IN_PLACE)) || !bz3_state->lzp_lut ||
+        ((flags & BZ3_FLAG_LOW_MEMORY) ? !bz3_state->occ_super || !bz3_state->occ_blocks : !bz3_state->sais_array)) {
+        bz3_free(bz3_state);
         return NULL;
     }
 
-    bz3_state->block_size = block_size;
-
     bz3_state->last_error = BZ3_OK;
 
     return bz3_state;
 }
 
+BZIP3_API struct bz3_state * bz3_new_flags(s32 block_size, s32 flags) { return bz3_new_ex(block_size, flags, NULL); }
+
+BZIP3_API struct bz3_state * bz3_new(s32 block_size) { return bz3_new_flags(block_size, 0); }
+
+/* Compression levels: the suggested block size, the minimum LZP match length and the entropy coder. Only the encoder
+   looks at the level; the choices made for a block are recorded in its model byte. */
+static const struct {
+    s32 block_size, lzp_min_match, coder;
+} levels[BZ3_LEVEL_MAX] = {
+    {    MiB(4), LZP_MIN_MATCH_SHORT, CODER_RANS },
+    {    MiB(8), LZP_MIN_MATCH_SHORT, CODER_FAST },
+    {    MiB(8), LZP_MIN_MATCH_SHORT, CODER_CM },
+    {   MiB(16), LZP_MIN_MATCH_SHORT, CODER_CM },
+    {   MiB(16), LZP_MIN_MATCH,       CODER_CM },
+    {   MiB(32), LZP_MIN_MATCH,       CODER_CM },
+    {   MiB(64), LZP_MIN_MATCH,       CODER_STRONG },
+    {  MiB(128), LZP_MIN_MATCH,       CODER_STRONG },
+    {  MiB(256), LZP_MIN_MATCH,       CODER_STRONG },
+};
+
+BZIP3_API s32 bz3_set_level(struct bz3_state * state, s32 level) {
+    if (level < 1 || level > BZ3_LEVEL_MAX) {
+        state->last_error = BZ3_ERR_UNSUPPORTED;
+        return BZ3_ERR_UNSUPPORTED;
+    }
+    state->level = level;
+    return BZ3_OK;
+}
+
+BZIP3_API s32 bz3_level_block_size(s32 level) {
+    if (level < 1 || level > BZ3_LEVEL_MAX) return -1;
+    return levels[level - 1].block_size;
+}
+
+BZIP3_API s32 bz3_set_dict(struct bz3_state * state, const struct bz3_dict * dict) {
+    state->dict = dict;
+    return BZ3_OK;
+}
+
+BZIP3_API struct bz3_state * bz3_new_workspace(s32 block_size, s32 flags, void * workspace, size_t workspace_size) {
+    if (!workspace) return NULL;
+
+    size_t padding = workspace_round((uintptr_t)workspace) - (uintptr_t)workspace;
+    if (workspace_size < padding + workspace_round(sizeof(struct workspace))) return NULL;
+
+    struct workspace * ws = (struct workspace *)((u8 *)workspace + padding);
+    ws->next = (u8 *)ws + workspace_round(sizeof(struct workspace));
+    ws->end = (u8 *)workspace + workspace_size;
+
+    struct bz3_allocator allocator = { workspace_alloc, workspace_free, ws };
+    return bz3_new_ex(block_size, flags, &allocator);
+}
+
 BZIP3_API void bz3_free(struct bz3_state * state) {
-    free(state->swap_buffer);
-    free(state->sais_array);
-    free(state->cm_state);
-    free(state->lzp_lut);
-    free(state);
+    struct bz3_allocator allocator = state->allocator;
+    state_free(state, state->swap_buffer, state->swap_mapped);
+    state_free(state, state->sais_array, state->sais_mapped);
+    state_free(state, state->occ_super, state->occ_super_mapped);
+    state_free(state, state->occ_blocks, state->occ_blocks_mapped);
+    if (state->cm_state) state_free(state, state->cm_state->C3, 0);
+    state_free(state, state->cm_state, 0);
+    state_free(state, state->lzp_lut, 0);
+    if (allocator.alloc)
+        allocator.free(allocator.opaque, state);
+    else
+        free(state);
 }
 
 #define swap(x, y)    \
@@ -582,45 +1286,80 @@ BZIP3_API void bz3_free(struct bz3_state * state) {
         y = tmp;      \
     }
 
+/* In-place states have no swap buffer. The SAIS array, which is at least four times as big, stands in for it
+   while it is not in use: the data is moved there before a stage runs, so that the stage writes its output
+   back into the caller's buffer. */
+#define in_place(state) ((state)->swap_buffer == NULL)
+#define scratch(state) ((state)->swap_buffer ? (state)->swap_buffer : (u8 *)(state)->sais_array)
+
 BZIP3_API s32 bz3_encode_block(struct bz3_state * state, u8 * buffer, s32 data_size) {
-    u8 *b1 = buffer, *b2 = state->swap_buffer;
+    u8 *b1 = buffer, *b2 = scratch(state);
 
     if (data_size > state->block_size) {
         state->last_error = BZ3_ERR_DATA_TOO_BIG;
         return -1;
     }
 
-    u32 crc32 = crc32sum(1, b1, data_size);
+    if (state->flags & BZ3_FLAG_LOW_MEMORY) {
+        state->last_error = BZ3_ERR_UNSUPPORTED;
+        return -1;
+    }
+
+    s32 t[256] = { 0 };
+    u32 crc32 = mrlec_stats(b1, data_size, 1, t);
 
     // Ignore small blocks. They won't benefit from the entropy coding step.
     if (data_size < 64) {
         memmove(b1 + 8, b1, data_size);
         write_neutral_s32(b1, crc32);
         write_neutral_s32(b1 + 4, -1);
+        state->last_error = BZ3_OK;
         return data_size + 8;
     }
 
     // Back to front:
     // bit 1: lzp | no lzp
     // bit 2: srt | no srt
-    s8 model = 0;
+    // bit 3: short lzp matches | normal lzp matches
+    // bits 4-5: entropy coder
+    // bit 6: dictionary | no dictionary
+    // bit 7: lzp table sized to the block | full lzp table
+    u8 model = levels[state->level - 1].coder << 4;
+    const s32 lzp_min_match = levels[state->level - 1].lzp_min_match;
+    const struct bz3_dict * dict = state->dict;
     s32 lzp_size, rle_size;
 
-    rle_size = mrlec(b1, data_size, b2);
+    if (dict) model |= 0x40;
+
+    rle_size = mrlec_worthwhile(t) ? mrlec(b1, data_size, b2, t) : data_size;
     if (rle_size < data_size) {
         swap(b1, b2);
         data_size = rle_size;
         model |= 4;
     }
 
-    lzp_size = lzp_compress(b1, b2, data_size, state->lzp_lut);
+    // Blocks of states too small for the full table say so, the table size then follows from the size of the data.
+    const int small_lzp = state->lzp_bits < LZP_DICTIONARY;
+    lzp_size = lzp_compress(b1, b2, data_size, state->lzp_lut, small_lzp ? lzp_bits(data_size) : LZP_DICTIONARY,
+                            lzp_min_match, dict ? dict->history : NULL, dict ? dict->history_size : 0);
     if (lzp_size > 0 && lzp_size < data_size) {
         swap(b1, b2);
         data_size = lzp_size;
         model |= 2;
+        if (lzp_min_match == LZP_MIN_MATCH_SHORT) model |= 8;
+        if (small_lzp) model |= 0x80;
     }
 
-    s32 bwt_idx = libsais_bwt(b1, b2, state->sais_array, data_size, 0, NULL);
+    s32 bwt_idx;
+    if (in_place(state)) {
+        // The scratch space is about to become the suffix array, so transform the data in the caller's buffer.
+        if (b1 != buffer) memcpy(buffer, b1, data_size);
+        b1 = scratch(state);
+        b2 = buffer;
+        bwt_idx = libsais_bwt(b2, b2, state->sais_array, data_size, 0, NULL);
+    } else {
+        bwt_idx = libsais_bwt(b1, b2, state->sais_array, data_size, 0, NULL);
+    }
     if (bwt_idx < 0) {
         state->last_error = BZ3_ERR_BWT;
         return -1;
@@ -631,11 +1370,26 @@ BZIP3_API s32 bz3_encode_block(struct bz3_state * state, u8 * buffer, s32 data_s
     if (model & 2) overhead++;  // LZP
     if (model & 4) overhead++;  // RLE
 
-    begin(state->cm_state);
-    state->cm_state->out_queue = b1 + overhead * 4 + 1;
-    state->cm_state->output_ptr = 0;
-    encode_bytes(state->cm_state, b2, data_size);
-    data_size = state->cm_state->output_ptr;
+    if (model_coder(model) == CODER_RANS) {
+        // The SAIS array is free again, past the output of in-place states.
+        mtf_encode(b2, data_size);
+        data_size = rans_encode(b2, data_size, b1 + overhead * 4 + 1,
+                                (u8 *)state->sais_array + bz3_bound(state->block_size));
+    } else {
+        if (model_coder(model) == CODER_STRONG && !strong_apm(state)) return -1;
+        begin(state->cm_state, model_coder(model), dict);
+        state->cm_state->out_queue = b1 + overhead * 4 + 1;
+        state->cm_state->output_ptr = 0;
+        state->cm_state->output_max = data_size - 16;
+        if (encode_bytes(state->cm_state, b2, data_size, model_coder(model)) < 0) {
+            // Incompressible data: the default coder does better anyway.
+            model &= ~0x30;
+            begin(state->cm_state, CODER_CM, dict);
+            state->cm_state->output_ptr = 0;
+            encode_bytes(state->cm_state, b2, data_size, CODER_CM);
+        }
+        data_size = state->cm_state->output_ptr;
+    }
 
     // Write the header. Starting with common entries.
     write_neutral_s32(b1, crc32);
@@ -653,16 +1407,23 @@ BZIP3_API s32 bz3_encode_block(struct bz3_state * state, u8 * buffer, s32 data_s
     return data_size + overhead * 4 + 1;
 }
 
-BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buffer_size, s32 compressed_size, s32 orig_size) {
+/* Decode a block read from `in' into `buffer'. With `in' apart from `buffer', the compressed data is never copied
+   and `buffer' only has to hold the decoded block and the stages that lead to it; that way the high level API
+   decodes straight into the output of the caller. `in' is left untouched, so should that fail, the caller can try
+   again with a buffer of its own. The outcome of a broken block depends on how much room it gets, so the high
+   level API does that for any error, which keeps them the same as with a buffer of `bz3_bound(block_size)' bytes. */
+static s32 decode_block(struct bz3_state * state, const u8 * in, u8 * buffer, size_t buffer_size, s32 compressed_size,
+                        s32 orig_size) {
     // Need minimum bytes for initial header, and compressed_size needs to fit within claimed buffer size.
-    if (buffer_size < 9 || buffer_size < compressed_size) {
+    const size_t in_size = in == buffer ? buffer_size : (size_t)(compressed_size < 0 ? 0 : compressed_size);
+    if (in_size < 9 || in_size < compressed_size) {
         state->last_error = BZ3_ERR_DATA_SIZE_TOO_SMALL;
         return -1;
     }
 
     // Read the header.
-    u32 crc32 = read_neutral_s32(buffer);
-    s32 bwt_idx = read_neutral_s32(buffer + 4);
+    u32 crc32 = read_neutral_s32(in);
+    s32 bwt_idx = read_neutral_s32(in + 4);
 
     if (compressed_size > bz3_bound(state->block_size) || compressed_size < 0) {
         state->last_error = BZ3_ERR_MALFORMED_HEADER;
@@ -681,28 +1442,41 @@ BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buf
             return -1;
         }
 
-        memmove(buffer, buffer + 8, compressed_size - 8);
+        memmove(buffer, in + 8, compressed_size - 8);
 
         if (crc32sum(1, buffer, compressed_size - 8) != crc32) {
             state->last_error = BZ3_ERR_CRC;
             return -1;
         }
 
+        state->last_error = BZ3_OK;
         return compressed_size - 8;
     }
 
-    s8 model = buffer[8];
+    u8 model = in[8];
+
+    // Bit 0 is unused. Bit 7 is only meaningful along with LZP.
+    if ((model & 1) || (model & 0x82) == 0x80) {
+        state->last_error = BZ3_ERR_MALFORMED_HEADER;
+        return -1;
+    }
+
+    const struct bz3_dict * dict = (model & 0x40) ? state->dict : NULL;
+    if ((model & 0x40) && !dict) {
+        state->last_error = BZ3_ERR_DICTIONARY;
+        return -1;
+    }
 
     // Ensure we have sufficient bytes for the rle/lzp sizes.
     size_t needed_header_size = 9 + ((model & 2) * 4) + ((model & 4) * 4);
-    if (buffer_size < needed_header_size) {
+    if (in_size < needed_header_size) {
         state->last_error = BZ3_ERR_DATA_SIZE_TOO_SMALL;
         return -1;
     }
 
     s32 lzp_size = -1, rle_size = -1, p = 0;
-    if (model & 2) lzp_size = read_neutral_s32(buffer + 9 + 4 * p++);
-    if (model & 4) rle_size = read_neutral_s32(buffer + 9 + 4 * p++);
+    if (model & 2) lzp_size = read_neutral_s32(in + 9 + 4 * p++);
+    if (model & 4) rle_size = read_neutral_s32(in + 9 + 4 * p++);
     p += 2;
 
     compressed_size -= p * 4 + 1;
@@ -718,6 +1492,13 @@ BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buf
         return -1;
     }
 
+    // The LZP table is sized to the data that went into LZP, which this state has to be able to hold.
+    const s32 lzp_table_bits = (model & 0x80) ? lzp_bits((model & 4) ? rle_size : orig_size) : LZP_DICTIONARY;
+    if ((model & 2) && lzp_table_bits > state->lzp_bits) {
+        state->last_error = BZ3_ERR_UNSUPPORTED;
+        return -1;
+    }
+
     // Size that undoing BWT+BCM should decompress into.
     s32 size_before_bwt;
 
@@ -737,14 +1518,34 @@ BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buf
     }
 
     // Decode the data.
-    u8 *b1 = buffer, *b2 = state->swap_buffer;
+    u8 *b1 = buffer, *b2 = scratch(state);
+    s32 freq[256] = { 0 };
+    u32 crc = 1;
 
-    begin(state->cm_state);
-    state->cm_state->in_queue = b1 + p * 4 + 1;
-    state->cm_state->input_ptr = 0;
-    state->cm_state->input_max = compressed_size;
+    // The last stage must write to the caller's buffer, so that no copy is needed at the end. The stages ping-pong
+    // between the two buffers, so with an even amount of them (BWT and either of LZP or RLE), invert the BWT in
+    // place. In-place states always write to the caller's buffer. The low memory decoder can't work in place.
+    const int unbwt_in_place = !(state->flags & BZ3_FLAG_LOW_MEMORY) && (in_place(state) || !(model & 2) != !(model & 4));
+
+    if (in_place(state)) {
+        memcpy(b2, in + p * 4 + 1, compressed_size);
+        swap(b1, b2);
+    }
 
-    decode_bytes(state->cm_state, b2, size_before_bwt);
+    if (model_coder(model) == CODER_RANS) {
+        if (rans_decode(in_place(state) ? b1 : in + p * 4 + 1, compressed_size, b2, size_before_bwt, freq) < 0) {
+            state->last_error = BZ3_ERR_CRC;
+            return -1;
+        }
+    } else {
+        if (model_coder(model) == CODER_STRONG && !strong_apm(state)) return -1;
+        begin(state->cm_state, model_coder(model), dict);
+        state->cm_state->in_queue = in_place(state) ? b1 : in + p * 4 + 1;
+        state->cm_state->input_ptr = 0;
+        state->cm_state->input_max = compressed_size;
+
+        decode_bytes(state->cm_state, b2, size_before_bwt, freq, model_coder(model));
+    }
     swap(b1, b2);
 
     if (bwt_idx > size_before_bwt) {
@@ -753,19 +1554,39 @@ BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buf
     }
 
     // Undo BWT
-    memset(state->sais_array, 0, sizeof(s32) * BWT_BOUND(state->block_size));
-    memset(b2, 0, size_before_bwt); // buffer b2, swap b1
-    if (libsais_unbwt(b1, b2, state->sais_array, size_before_bwt, NULL, bwt_idx) < 0) {
-        state->last_error = BZ3_ERR_BWT;
-        return -1;
+    if (state->flags & BZ3_FLAG_LOW_MEMORY) {
+        if (occ_unbwt(b1, b2, state->occ_super, state->occ_blocks, size_before_bwt, bwt_idx) < 0) {
+            state->last_error = BZ3_ERR_BWT;
+            return -1;
+        }
+        swap(b1, b2);
+    } else {
+        // No need to clear the SAIS array or the output: libsais defines every entry of the former
+        // that decoding can reach, even for malformed input, and writes all of the latter. The entropy
+        // coder has already counted the symbols, so libsais doesn't have to.
+        if ((size_before_bwt <= SMALL_UNBWT
+                 ? small_unbwt(b1, unbwt_in_place ? b1 : b2, (u32 *)state->sais_array, size_before_bwt, freq, bwt_idx)
+                 : libsais_unbwt(b1, unbwt_in_place ? b1 : b2, state->sais_array, size_before_bwt, freq, bwt_idx)) < 0) {
+            state->last_error = BZ3_ERR_BWT;
+            return -1;
+        }
+        if (!unbwt_in_place) swap(b1, b2);
     }
-    swap(b1, b2);
 
     s32 size_src = size_before_bwt;
 
     // Undo LZP
     if (model & 2) {
-        size_src = lzp_decompress(b1, b2, lzp_size, bz3_bound(state->block_size), state->lzp_lut);
+        s32 max = bz3_bound(state->block_size);
+        if (in_place(state)) {
+            memcpy(b2, b1, lzp_size);
+            swap(b1, b2);
+        }
+        // Output going to the caller's buffer must be capped at its size.
+        if (b2 == buffer && buffer_size < (size_t)max) max = (s32)buffer_size;
+        size_src = lzp_decompress(b1, b2, lzp_size, max, state->lzp_lut, lzp_table_bits,
+                                  (model & 8) ? LZP_MIN_MATCH_SHORT : LZP_MIN_MATCH, dict ? dict->history : NULL,
+                                  dict ? dict->history_size : 0, (model & 4) ? NULL : &crc);
         if (size_src == -1) {
             state->last_error = BZ3_ERR_CRC;
             return -1;
@@ -781,8 +1602,12 @@ BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buf
     }
 
     if (model & 4) { 
+        if (in_place(state)) {
+            memcpy(b2, b1, size_src);
+            swap(b1, b2);
+        }
         // SAFETY: mrled is capped at orig_size, which is in bounds.
-        int err = mrled(b1, b2, orig_size, size_src);
+        int err = mrled(b1, b2, orig_size, size_src, &crc);
         if (err) {
             state->last_error = BZ3_ERR_CRC;
             return -1;
@@ -800,7 +1625,10 @@ BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buf
 
     if (b1 != buffer) memcpy(buffer, b1, size_src);
 
-    if (crc32 != crc32sum(1, buffer, size_src)) {
+    // Without LZP and RLE, the inverse BWT comes last and the checksum is yet to be computed.
+    if (!(model & 6)) crc = crc32sum(1, buffer, size_src);
+
+    if (crc32 != crc) {
         state->last_error = BZ3_ERR_CRC;
         return -1;
     }
@@ -808,11 +1636,21 @@ BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buf
     return size_src;
 }
 
+BZIP3_API s32 bz3_decode_block(struct bz3_state * state, u8 * buffer, size_t buffer_size, s32 compressed_size, s32 orig_size) {
+    return decode_block(state, buffer, buffer, buffer_size, compressed_size, orig_size);
+}
+
 #undef swap
+#undef in_place
+#undef scratch
 
 #ifdef PTHREAD
 
     #include <pthread.h>
+    #ifndef _WIN32
+        #include <fcntl.h>
+        #include <unistd.h>
+    #endif
 
 typedef struct {
     struct bz3_state * state;
@@ -869,57 +1707,662 @@ BZIP3_API void bz3_decode_blocks(struct bz3_state * states[], u8 * buffers[], si
     for (s32 i = 0; i < n; i++) pthread_join(threads[i], NULL);
 }
 
-#endif
+/* Pools. The worker threads take jobs off a queue in the order they came in, each on a state of its own. Jobs
+   without a callback end up on a second queue, for `bz3_pool_poll()'; the pipe holds a byte for as long as that
+   one isn't empty, which is what makes it pollable. */
 
-/* High level API implementations. */
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE };
 
-BZIP3_API int bz3_compress(u32 block_size, const u8 * const in, u8 * out, size_t in_size, size_t * out_size) {
-    if (block_size > in_size) block_size = bz3_bound(in_size);
-    block_size = block_size <= KiB(65) ? KiB(65) : block_size;
+struct bz3_job {
+    struct bz3_job * next;
+    int decode, stage, status;
+    u8 * buffer;
+    size_t buffer_size;
+    s32 size, orig_size, result;
+    bz3_job_done done;
+    void * user;
+};
 
-    struct bz3_state * state = bz3_new(block_size);
-    if (!state) return BZ3_ERR_INIT;
+struct bz3_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work, completed;
+    struct bz3_job *queued, *queued_tail, *finished, *finished_tail;
+    // Jobs without a callback that are yet to be polled.
+    size_t unpolled;
+    int stop, fd[2];
+    s32 threads;
+    pthread_t * thread;
+    struct bz3_state ** states;
+};
 
-    u8 * compression_buf = malloc(bz3_bound(block_size));
-    if (!compression_buf) {
-        bz3_free(state);
-        return BZ3_ERR_INIT;
+struct pool_worker {
+    struct bz3_pool * pool;
+    struct bz3_state * state;
+};
+
+// Raise or lower the pipe. Neither can block, and the pipe never holds more than the one byte, so there is nothing
+// to do about failures.
+static void pool_signal(struct bz3_pool * pool, int raise) {
+#ifndef _WIN32
+    u8 byte = 1;
+    ssize_t ret = raise ? write(pool->fd[1], &byte, 1) : read(pool->fd[0], &byte, 1);
+    (void)ret;
+#else
+    (void)pool;
+    (void)raise;
+#endif
+}
+
+static void job_complete(struct bz3_pool * pool, struct bz3_job * job) {
+    if (job->done) {
+        // The callback may free the job, so it is the last to touch it.
+        pthread_mutex_lock(&pool->lock);
+        job->stage = JOB_DONE;
+        pthread_mutex_unlock(&pool->lock);
+        job->done(job, job->user);
+        return;
     }
 
-    size_t buf_max = *out_size;
-    *out_size = 0;
+    pthread_mutex_lock(&pool->lock);
+    job->stage = JOB_DONE;
+    job->next = NULL;
+    if (pool->finished) {
+        pool->finished_tail->next = job;
+    } else {
+        pool->finished = job;
+        pool_signal(pool, 1);
+    }
+    pool->finished_tail = job;
+    pthread_cond_broadcast(&pool->completed);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    u32 n_blocks = in_size / block_size;
-    if (in_size % block_size) n_blocks++;
+static void * pool_work(void * _worker) {
+    struct pool_worker * worker = _worker;
+    struct bz3_pool * pool = worker->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->queued && !pool->stop) pthread_cond_wait(&pool->work, &pool->lock);
+        struct bz3_job * job = pool->queued;
+        if (job) {
+            pool->queued = job->next;
+            job->stage = JOB_RUNNING;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!job) break;
+
+        if (job->decode)
+            job->result =
+                bz3_decode_block(worker->state, job->buffer, job->buffer_size, job->size, job->orig_size);
+        else
+            job->result = bz3_encode_block(worker->state, job->buffer, job->size);
+        job->status = bz3_last_error(worker->state);
+        job_complete(pool, job);
+    }
+
+    free(worker);
+    return NULL;
+}
+
+BZIP3_API struct bz3_pool * bz3_pool_new(s32 threads, s32 block_size) {
+    if (threads < 1) return NULL;
+
+    struct bz3_pool * pool = malloc(sizeof(struct bz3_pool));
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof(struct bz3_pool));
+    pool->fd[0] = pool->fd[1] = -1;
+    pool->thread = malloc(threads * sizeof(pthread_t));
+    pool->states = malloc(threads * sizeof(struct bz3_state *));
+    if (!pool->thread || !pool->states) {
+        free(pool->thread);
+        free(pool->states);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->completed, NULL);
+
+#ifndef _WIN32
+    if (pipe(pool->fd) < 0) {
+        pool->fd[0] = pool->fd[1] = -1;
+        bz3_pool_free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(pool->fd[i], F_SETFL, fcntl(pool->fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(pool->fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    for (s32 t = 0; t < threads; t++) {
+        struct pool_worker * worker = malloc(sizeof(struct pool_worker));
+        pool->states[t] = bz3_new(block_size);
+        if (!worker || !pool->states[t]) {
+            free(worker);
+            if (pool->states[t]) bz3_free(pool->states[t]);
+            break;
+        }
+        worker->pool = pool;
+        worker->state = pool->states[t];
+        if (pthread_create(&pool->thread[t], NULL, pool_work, worker)) {
+            free(worker);
+            bz3_free(pool->states[t]);
+            break;
+        }
+        pool->threads++;
+    }
+
+    if (pool->threads < threads) {
+        bz3_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+BZIP3_API void bz3_pool_free(struct bz3_pool * pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    struct bz3_job * job = pool->queued;
+    pool->queued = NULL;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Queued jobs are canceled; the running ones are waited for.
+    while (job) {
+        struct bz3_job * next = job->next;
+        job->status = BZ3_ERR_CANCELED;
+        job->result = -1;
+        job_complete(pool, job);
+        job = next;
+    }
+    for (s32 t = 0; t < pool->threads; t++) pthread_join(pool->thread[t], NULL);
+    for (s32 t = 0; t < pool->threads; t++) bz3_free(pool->states[t]);
+
+#ifndef _WIN32
+    if (pool->fd[0] >= 0) close(pool->fd[0]);
+    if (pool->fd[1] >= 0) close(pool->fd[1]);
+#endif
+    pthread_cond_destroy(&pool->completed);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->thread);
+    free(pool->states);
+    free(pool);
+}
+
+BZIP3_API int bz3_pool_fd(struct bz3_pool * pool) { return pool->fd[0]; }
+
+static struct bz3_job * pool_submit(struct bz3_pool * pool, struct bz3_job * job) {
+    job->next = NULL;
+    job->stage = JOB_QUEUED;
+    job->status = BZ3_OK;
+    job->result = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queued)
+        pool->queued_tail->next = job;
+    else
+        pool->queued = job;
+    pool->queued_tail = job;
+    if (!job->done) pool->unpolled++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+BZIP3_API struct bz3_job * bz3_pool_encode(struct bz3_pool * pool, u8 * buffer, s32 size, bz3_job_done done,
+                                           void * user) {
+    struct bz3_job * job = malloc(sizeof(struct bz3_job));
+    if (!job) return NULL;
+    job->decode = 0;
+    job->buffer = buffer;
+    job->buffer_size = 0;
+    job->size = size;
+    job->orig_size = 0;
+    job->done = done;
+    job->user = user;
+    return pool_submit(pool, job);
+}
+
+BZIP3_API struct bz3_job * bz3_pool_decode(struct bz3_pool * pool, u8 * buffer, size_t buffer_size,
+                                           s32 compressed_size, s32 orig_size, bz3_job_done done, void * user) {
+    struct bz3_job * job = malloc(sizeof(struct bz3_job));
+    if (!job) return NULL;
+    job->decode = 1;
+    job->buffer = buffer;
+    job->buffer_size = buffer_size;
+    job->size = compressed_size;
+    job->orig_size = orig_size;
+    job->done = done;
+    job->user = user;
+    return pool_submit(pool, job);
+}
+
+BZIP3_API struct bz3_job * bz3_pool_poll(struct bz3_pool * pool, int wait) {
+    pthread_mutex_lock(&pool->lock);
+    while (wait && !pool->finished && pool->unpolled) pthread_cond_wait(&pool->completed, &pool->lock);
+    struct bz3_job * job = pool->finished;
+    if (job) {
+        pool->finished = job->next;
+        pool->unpolled--;
+        if (!pool->finished) pool_signal(pool, 0);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+BZIP3_API int bz3_pool_cancel(struct bz3_pool * pool, struct bz3_job * job) {
+    pthread_mutex_lock(&pool->lock);
+    int queued = job->stage == JOB_QUEUED;
+    if (queued) {
+        struct bz3_job ** link = &pool->queued;
+        struct bz3_job * prev = NULL;
+        while (*link != job) {
+            prev = *link;
+            link = &(*link)->next;
+        }
+        *link = job->next;
+        if (pool->queued_tail == job) pool->queued_tail = prev;
+        job->stage = JOB_RUNNING;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!queued) return 0;
+
+    job->status = BZ3_ERR_CANCELED;
+    job->result = -1;
+    job_complete(pool, job);
+    return 1;
+}
+
+BZIP3_API int bz3_job_status(const struct bz3_job * job) { return job->status; }
 
-    if (buf_max < 13 || buf_max < bz3_bound(in_size)) {
-        bz3_free(state);
-        free(compression_buf);
-        return BZ3_ERR_DATA_TOO_BIG;
+BZIP3_API s32 bz3_job_size(const struct bz3_job * job) { return job->result; }
+
+BZIP3_API void * bz3_job_user(const struct bz3_job * job) { return job->user; }
+
+BZIP3_API void bz3_job_free(struct bz3_job * job) { free(job); }
+
+#endif
+
+/* Dictionaries. They are stored as the signature "BZ3D", the identifier, the size of the history, the history and
+   the model, as little endian 16-bit counters. */
+
+#define DICT_HEADER_SIZE 12
+#define DICT_MODEL_SIZE ((256 + 256 * 256 + 512 * 17) * 2)
+
+static u8 * write_u16s(u8 * out, const u16 * v, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        *out++ = v[i] & 0xFF;
+        *out++ = v[i] >> 8;
     }
+    return out;
+}
+
+static const u8 * read_u16s(const u8 * in, u16 * v, size_t n) {
+    for (size_t i = 0; i < n; i++, in += 2) v[i] = in[0] | in[1] << 8;
+    return in;
+}
+
+/* The history is picked a segment at a time, greedily, by how common the 16 byte substrings of a segment are among
+   the samples, as in the COVER algorithm of zstd. Only substrings found in at least two samples count, and those
+   already in the history no longer do. The segments then go in the history in the order of the samples, so that
+   neighbouring ones can still be matched across. */
+
+#define DICT_KMER 16
+#define DICT_SEGMENT 256
+#define DICT_HASH_BITS 20
 
+struct dict_segment {
+    size_t offset;
+    u64 score;
+    u32 length;
+    u8 chosen;
+};
+
+static u32 dict_hash(const u8 * p) {
+    u64 a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, p + 8, sizeof(b));
+    return (u32)((a * 0x9E3779B97F4A7C15ULL ^ b * 0xC2B2AE3D27D4EB4FULL) >> (64 - DICT_HASH_BITS));
+}
+
+static u64 dict_score(const u8 * samples, const struct dict_segment * seg, const u32 * count) {
+    u64 score = 0;
+    for (u32 i = 0; i + DICT_KMER <= seg->length; i++) {
+        const u32 c = count[dict_hash(samples + seg->offset + i)];
+        if (c > 1) score += c;
+    }
+    return score;
+}
+
+static void dict_sift_down(u32 * heap, size_t n, size_t i, const struct dict_segment * segs) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && segs[heap[l]].score > segs[heap[m]].score) m = l;
+        if (r < n && segs[heap[r]].score > segs[heap[m]].score) m = r;
+        if (m == i) return;
+        u32 t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/* Fill up to `capacity' bytes of `history' from the samples. Returns the amount of bytes used, or -1 if allocation
+   fails. */
+static s32 dict_select(const u8 * samples, const size_t * sample_sizes, size_t n_samples, u8 * history,
+                       size_t capacity) {
+    size_t total = 0, n_segs = 0;
+    for (size_t i = 0; i < n_samples; i++) {
+        total += sample_sizes[i];
+        n_segs += (sample_sizes[i] + DICT_SEGMENT - 1) / DICT_SEGMENT;
+    }
+
+    if (total <= capacity) {
+        memcpy(history, samples, total);
+        return total;
+    }
+
+    u32 * count = calloc(2 << DICT_HASH_BITS, sizeof(u32));
+    struct dict_segment * segs = malloc(n_segs * sizeof(struct dict_segment));
+    u32 * heap = malloc(n_segs * sizeof(u32));
+    if (!count || !segs || !heap) {
+        free(count);
+        free(segs);
+        free(heap);
+        return -1;
+    }
+
+    // Count the samples each substring appears in, remembering the last one seen.
+    u32 * seen = count + (1 << DICT_HASH_BITS);
+    size_t offset = 0;
+    n_segs = 0;
+    for (size_t i = 0; i < n_samples; offset += sample_sizes[i++]) {
+        for (size_t j = 0; j + DICT_KMER <= sample_sizes[i]; j++) {
+            const u32 h = dict_hash(samples + offset + j);
+            if (seen[h] != i + 1) {
+                seen[h] = i + 1;
+                count[h]++;
+            }
+        }
+        for (size_t j = 0; j + DICT_KMER <= sample_sizes[i]; j += DICT_SEGMENT) {
+            segs[n_segs].offset = offset + j;
+            segs[n_segs].length = sample_sizes[i] - j < DICT_SEGMENT ? sample_sizes[i] - j : DICT_SEGMENT;
+            segs[n_segs].chosen = 0;
+            n_segs++;
+        }
+    }
+
+    for (size_t i = 0; i < n_segs; i++) {
+        segs[i].score = dict_score(samples, &segs[i], count);
+        heap[i] = i;
+    }
+    for (size_t i = n_segs / 2; i-- > 0;) dict_sift_down(heap, n_segs, i, segs);
+
+    // Lazy greedy selection: scores only ever drop, so a segment whose score is still up to date is the best one.
+    size_t used = 0, heap_size = n_segs;
+    while (heap_size && used < capacity) {
+        struct dict_segment * top = &segs[heap[0]];
+        const u64 score = dict_score(samples, top, count);
+        if (score != top->score) {
+            top->score = score;
+            dict_sift_down(heap, heap_size, 0, segs);
+            continue;
+        }
+        if (!score) break;
+
+        top->chosen = 1;
+        if (top->length > capacity - used) top->length = capacity - used;
+        used += top->length;
+        for (u32 i = 0; i + DICT_KMER <= top->length; i++) count[dict_hash(samples + top->offset + i)] = 0;
+
+        heap[0] = heap[--heap_size];
+        dict_sift_down(heap, heap_size, 0, segs);
+    }
+
+    used = 0;
+    for (size_t i = 0; i < n_segs; i++) {
+        if (!segs[i].chosen) continue;
+        memcpy(history + used, samples + segs[i].offset, segs[i].length);
+        used += segs[i].length;
+    }
+
+    free(count);
+    free(segs);
+    free(heap);
+    return used;
+}
+
+BZIP3_API size_t bz3_dict_bound(size_t history_size) { return DICT_HEADER_SIZE + history_size + DICT_MODEL_SIZE; }
+
+BZIP3_API int bz3_train_dict(const u8 * samples, const size_t * sample_sizes, size_t n_samples, u32 dict_id,
+                             u8 * dict, size_t * dict_size) {
+    size_t capacity = *dict_size, total = 0, largest = 0;
+    *dict_size = 0;
+
+    if (capacity < bz3_dict_bound(0)) return BZ3_ERR_DATA_TOO_BIG;
+
+    for (size_t i = 0; i < n_samples; i++) {
+        total += sample_sizes[i];
+        if (sample_sizes[i] > largest) largest = sample_sizes[i];
+    }
+
+    size_t history_size = capacity - bz3_dict_bound(0);
+    if (history_size > total) history_size = total;
+    if (history_size > BZ3_DICT_MAX_HISTORY) history_size = BZ3_DICT_MAX_HISTORY;
+
+    struct bz3_dict * d = malloc(sizeof(struct bz3_dict) + history_size);
+    if (!d) return BZ3_ERR_INIT;
+    d->history = (u8 *)(d + 1);
+    d->history_size = dict_select(samples, sample_sizes, n_samples, (u8 *)(d + 1), history_size);
+
+    // Samples bigger than the largest block size considered are trained on up to that size.
+    s32 block_size = largest < 1 ? 1 : largest > MiB(16) ? MiB(16) : (s32)largest;
+    struct bz3_state * state = d->history_size < 0 ? NULL : bz3_new(block_size);
+    u8 * buffer = state ? malloc(bz3_bound(block_size)) : NULL;
+    if (!buffer) {
+        if (state) bz3_free(state);
+        free(d);
+        return BZ3_ERR_INIT;
+    }
+
+    // Prime the model by compressing the samples one after another, each starting from the model the previous one
+    // left behind.
+    begin(state->cm_state, CODER_CM, NULL);
+    bz3_set_dict(state, d);
+    for (size_t i = 0, offset = 0; i < n_samples; offset += sample_sizes[i++]) {
+        cm_all_rows(state->cm_state);
+        memcpy(d->C0, state->cm_state->C0, sizeof(d->C0));
+        memcpy(d->C1, state->cm_state->C1, sizeof(d->C1));
+        memcpy(d->C2, state->cm_state->C2, sizeof(d->C2));
+
+        s32 size = sample_sizes[i] < (size_t)block_size ? (s32)sample_sizes[i] : block_size;
+        memcpy(buffer, samples + offset, size);
+        if (bz3_encode_block(state, buffer, size) < 0) {
+            int error = state->last_error;
+            bz3_free(state);
+            free(buffer);
+            free(d);
+            return error;
+        }
+    }
+    cm_all_rows(state->cm_state);
+    memcpy(d->C0, state->cm_state->C0, sizeof(d->C0));
+    memcpy(d->C1, state->cm_state->C1, sizeof(d->C1));
+    memcpy(d->C2, state->cm_state->C2, sizeof(d->C2));
+
+    u8 * p = dict;
+    memcpy(p, "BZ3D", 4);
+    write_neutral_s32(p + 8, d->history_size);
+    memcpy(p + DICT_HEADER_SIZE, d->history, d->history_size);
+    p = write_u16s(p + DICT_HEADER_SIZE + d->history_size, d->C0, 256);
+    p = write_u16s(p, &d->C1[0][0], 256 * 256);
+    p = write_u16s(p, &d->C2[0][0], 512 * 17);
+    *dict_size = p - dict;
+
+    if (!dict_id) dict_id = crc32sum(1, dict + 8, *dict_size - 8) | 1;
+    write_neutral_s32(dict + 4, dict_id);
+
+    bz3_free(state);
+    free(buffer);
+    free(d);
+    return BZ3_OK;
+}
+
+BZIP3_API struct bz3_dict * bz3_dict_new(const u8 * dict, size_t dict_size) {
+    if (dict_size < bz3_dict_bound(0) || memcmp(dict, "BZ3D", 4)) return NULL;
+
+    s32 history_size = read_neutral_s32(dict + 8);
+    if (history_size < 0 || history_size > BZ3_DICT_MAX_HISTORY || dict_size != bz3_dict_bound(history_size))
+        return NULL;
+
+    struct bz3_dict * d = malloc(sizeof(struct bz3_dict) + history_size);
+    if (!d) return NULL;
+
+    d->id = read_neutral_s32(dict + 4);
+    d->history_size = history_size;
+    d->history = (u8 *)(d + 1);
+    memcpy(d + 1, dict + DICT_HEADER_SIZE, history_size);
+    const u8 * p = read_u16s(dict + DICT_HEADER_SIZE + history_size, d->C0, 256);
+    p = read_u16s(p, &d->C1[0][0], 256 * 256);
+    read_u16s(p, &d->C2[0][0], 512 * 17);
+
+    return d;
+}
+
+BZIP3_API u32 bz3_dict_id(const struct bz3_dict * dict) { return dict->id; }
+
+BZIP3_API void bz3_dict_free(struct bz3_dict * dict) { free(dict); }
+
+/* High level API implementations. */
+
+/* The high level API keeps its state and buffer in a context, which the plain functions set up for a single call.
+   Frames compressed with a dictionary have the signature "BZ3d1" and the identifier of the dictionary after the
+   block count. */
+
+struct bz3_ctx {
+    struct bz3_state * state;
+    u8 * buffer;
+    size_t buffer_size;
+    const struct bz3_dict * dict;
+    // Set by bz3_ctx_set_small_blocks.
+    int small_blocks;
+};
+
+static void ctx_release(struct bz3_ctx * ctx) {
+    if (ctx->state) bz3_free(ctx->state);
+    free(ctx->buffer);
+    ctx->state = NULL;
+    ctx->buffer = NULL;
+    ctx->buffer_size = 0;
+}
+
+/* Make sure that the context can encode, or decode, blocks of `block_size' bytes. States on either side of 65KiB
+   encode blocks differently, see lzp_state_bits, so an encoder is only reused for blocks of its own kind, to keep
+   the output the same as that of a fresh state. Any state big enough can decode. */
+static int ctx_reserve(struct bz3_ctx * ctx, u32 block_size, int decode) {
+    struct bz3_state * state = ctx->state;
+    int fits = state && (u32)state->block_size >= block_size;
+    if (fits && !decode) fits = (state->block_size < KiB(65)) == (block_size < KiB(65));
+
+    if (!fits) {
+        if (state) bz3_free(state);
+        ctx->state = bz3_new(block_size);
+        if (!ctx->state) return BZ3_ERR_INIT;
+    }
+
+    if (ctx->buffer_size < bz3_bound(block_size)) {
+        free(ctx->buffer);
+        ctx->buffer_size = 0;
+        ctx->buffer = malloc(bz3_bound(block_size));
+        if (!ctx->buffer) return BZ3_ERR_INIT;
+        ctx->buffer_size = bz3_bound(block_size);
+    }
+
+    bz3_set_dict(ctx->state, ctx->dict);
+    return BZ3_OK;
+}
+
+/* Frames of inputs smaller than the block size get a block size that fits the input. Unless small blocks were asked
+   for, it is kept to at least 65KiB: older decoders reject anything smaller. */
+static u32 frame_block_size(u32 block_size, size_t in_size, int small_blocks) {
+    if (block_size > in_size) block_size = bz3_bound(in_size);
+    if (!small_blocks) return block_size < KiB(65) ? KiB(65) : block_size;
+    return block_size < 1 ? 1 : block_size;
+}
+
+static size_t write_frame_header(u8 * out, u32 block_size, u32 n_blocks, const struct bz3_dict * dict) {
     out[0] = 'B';
     out[1] = 'Z';
     out[2] = '3';
-    out[3] = 'v';
+    out[3] = dict ? 'd' : 'v';
     out[4] = '1';
     write_neutral_s32(out + 5, block_size);
     write_neutral_s32(out + 9, n_blocks);
-    *out_size += 13;
+    if (dict) write_neutral_s32(out + 13, dict->id);
+    return dict ? 17 : 13;
+}
+
+/* Parse the header of a frame, leaving the size of the header in `header_size'. */
+static int read_frame_header(const struct bz3_ctx * ctx, const u8 * in, size_t in_size, u32 * block_size,
+                             u32 * n_blocks, size_t * header_size) {
+    if (in_size < 13) return BZ3_ERR_MALFORMED_HEADER;
+    if (in[0] != 'B' || in[1] != 'Z' || in[2] != '3' || (in[3] != 'v' && in[3] != 'd') || in[4] != '1') {
+        return BZ3_ERR_MALFORMED_HEADER;
+    }
+    *block_size = read_neutral_s32(in + 5);
+    *n_blocks = read_neutral_s32(in + 9);
+    *header_size = 13;
+
+    if (in[3] == 'd') {
+        if (in_size < 17) return BZ3_ERR_MALFORMED_HEADER;
+        if (!ctx->dict || (u32)read_neutral_s32(in + 13) != ctx->dict->id) return BZ3_ERR_DICTIONARY;
+        *header_size = 17;
+    }
+
+    // A context with a bigger state at hand would take these.
+    if (*block_size < 1 || *block_size > MiB(511)) return BZ3_ERR_INIT;
+    return BZ3_OK;
+}
+
+static int compress_frame(struct bz3_ctx * ctx, u32 block_size, const u8 * const in, u8 * out, size_t in_size,
+                          size_t * out_size) {
+    const struct bz3_dict * dict = ctx->dict;
+    const size_t header_size = dict ? 17 : 13;
+
+    block_size = frame_block_size(block_size, in_size, ctx->small_blocks);
+
+    int error = ctx_reserve(ctx, block_size, 0);
+    if (error != BZ3_OK) return error;
+
+    struct bz3_state * state = ctx->state;
+    u8 * compression_buf = ctx->buffer;
+
+    size_t buf_max = *out_size;
+    *out_size = 0;
+
+    u32 n_blocks = in_size / block_size;
+    if (in_size % block_size) n_blocks++;
+
+    if (buf_max < header_size || buf_max < bz3_bound(in_size)) return BZ3_ERR_DATA_TOO_BIG;
+
+    *out_size += write_frame_header(out, block_size, n_blocks, dict);
 
     // Compress and write the blocks.
     size_t in_offset = 0;
     for (u32 i = 0; i < n_blocks; i++) {
         s32 size = block_size;
-        if (i == n_blocks - 1) size = in_size % block_size;
+        if (i == n_blocks - 1 && in_size % block_size) size = in_size % block_size;
         memcpy(compression_buf, in + in_offset, size);
         s32 out_size_block = bz3_encode_block(state, compression_buf, size);
-        if (bz3_last_error(state) != BZ3_OK) {
-            s8 last_error = state->last_error;
-            bz3_free(state);
-            free(compression_buf);
-            return last_error;
-        }
+        if (bz3_last_error(state) != BZ3_OK) return state->last_error;
+        // Very small blocks add more headers than `bz3_bound()' makes room for.
+        if (*out_size + 8 + out_size_block > buf_max) return BZ3_ERR_DATA_TOO_BIG;
         memcpy(out + *out_size + 8, compression_buf, out_size_block);
         write_neutral_s32(out + *out_size, out_size_block);
         write_neutral_s32(out + *out_size + 4, size);
@@ -927,100 +2370,770 @@ BZIP3_API int bz3_compress(u32 block_size, const u8 * const in, u8 * out, size_t
         in_offset += size;
     }
 
-    bz3_free(state);
-    free(compression_buf);
     return BZ3_OK;
 }
 
-BZIP3_API int bz3_decompress(const uint8_t * in, uint8_t * out, size_t in_size, size_t * out_size) {
-    if (in_size < 13) return BZ3_ERR_MALFORMED_HEADER;
-    if (in[0] != 'B' || in[1] != 'Z' || in[2] != '3' || in[3] != 'v' || in[4] != '1') {
-        return BZ3_ERR_MALFORMED_HEADER;
-    }
-    u32 block_size = read_neutral_s32(in + 5);
-    u32 n_blocks = read_neutral_s32(in + 9);
-    in_size -= 13;
-    in += 13;
+static int decompress_frame(struct bz3_ctx * ctx, const uint8_t * in, uint8_t * out, size_t in_size,
+                            size_t * out_size) {
+    u32 block_size, n_blocks;
+    size_t header_size;
+    int error = read_frame_header(ctx, in, in_size, &block_size, &n_blocks, &header_size);
+    if (error != BZ3_OK) return error;
+    const int with_dict = header_size == 17;
+    in_size -= header_size;
+    in += header_size;
 
-    struct bz3_state * state = bz3_new(block_size);
-    if (!state) return BZ3_ERR_INIT;
+    error = ctx_reserve(ctx, block_size, 1);
+    if (error != BZ3_OK) return error;
 
-    size_t compression_buf_size = bz3_bound(block_size);
-    u8 * compression_buf = malloc(compression_buf_size);
-    if (!compression_buf) {
-        bz3_free(state);
-        return BZ3_ERR_INIT;
-    }
+    struct bz3_state * state = ctx->state;
+    u8 * compression_buf = ctx->buffer;
+    size_t compression_buf_size = ctx->buffer_size;
+
+    // Frames without a dictionary never need one.
+    if (!with_dict) bz3_set_dict(state, NULL);
 
     size_t buf_max = *out_size;
     *out_size = 0;
 
     for (u32 i = 0; i < n_blocks; i++) {
-        if (in_size < 8) {
-        malformed_header:
-            bz3_free(state);
-            free(compression_buf);
-            return BZ3_ERR_MALFORMED_HEADER;
-        }
+        if (in_size < 8) return BZ3_ERR_MALFORMED_HEADER;
         s32 size = read_neutral_s32(in);
-        if (size < 0 || size > block_size) goto malformed_header;
-        if (in_size < size + 8) {
-            bz3_free(state);
-            free(compression_buf);
-            return BZ3_ERR_TRUNCATED_DATA;
-        }
+        // Incompressible blocks come out a little bigger than the block size.
+        if (size < 0 || (size_t)size > bz3_bound(block_size)) return BZ3_ERR_MALFORMED_HEADER;
+        if (in_size < size + 8) return BZ3_ERR_TRUNCATED_DATA;
         s32 orig_size = read_neutral_s32(in + 4);
-        if (orig_size < 0) goto malformed_header;
-        if (buf_max < *out_size + orig_size) {
-            bz3_free(state);
-            free(compression_buf);
-            return BZ3_ERR_DATA_TOO_BIG;
+        if (orig_size < 0) return BZ3_ERR_MALFORMED_HEADER;
+        if (buf_max < *out_size + orig_size) return BZ3_ERR_DATA_TOO_BIG;
+        // Decode straight into the output, which is all ours past the blocks decoded so far.
+        decode_block(state, in + 8, out + *out_size, buf_max - *out_size, size, orig_size);
+        if (state->last_error != BZ3_OK) {
+            decode_block(state, in + 8, compression_buf, compression_buf_size, size, orig_size);
+            if (state->last_error == BZ3_OK) memcpy(out + *out_size, compression_buf, orig_size);
         }
-        memcpy(compression_buf, in + 8, size);
-        bz3_decode_block(state, compression_buf, compression_buf_size, size, orig_size);
-        if (bz3_last_error(state) != BZ3_OK) {
-            s8 last_error = state->last_error;
-            bz3_free(state);
-            free(compression_buf);
-            return last_error;
-        }
-        memcpy(out + *out_size, compression_buf, orig_size);
+        if (bz3_last_error(state) != BZ3_OK) return state->last_error;
         *out_size += orig_size;
         in += size + 8;
         in_size -= size + 8;
     }
 
-    bz3_free(state);
-    free(compression_buf);
+    return BZ3_OK;
+}
+
+BZIP3_API int bz3_compress(u32 block_size, const u8 * const in, u8 * out, size_t in_size, size_t * out_size) {
+    struct bz3_ctx ctx = { 0 };
+    int error = compress_frame(&ctx, block_size, in, out, in_size, out_size);
+    ctx_release(&ctx);
+    return error;
+}
+
+BZIP3_API int bz3_compress_dict(u32 block_size, const struct bz3_dict * dict, const u8 * in, u8 * out,
+                                size_t in_size, size_t * out_size) {
+    struct bz3_ctx ctx = { 0 };
+    ctx.dict = dict;
+    int error = compress_frame(&ctx, block_size, in, out, in_size, out_size);
+    ctx_release(&ctx);
+    return error;
+}
+
+BZIP3_API int bz3_decompress_dict(const struct bz3_dict * dict, const uint8_t * in, uint8_t * out, size_t in_size,
+                                  size_t * out_size) {
+    struct bz3_ctx ctx = { 0 };
+    ctx.dict = dict;
+    int error = decompress_frame(&ctx, in, out, in_size, out_size);
+    ctx_release(&ctx);
+    return error;
+}
+
+BZIP3_API int bz3_decompress(const uint8_t * in, uint8_t * out, size_t in_size, size_t * out_size) {
+    return bz3_decompress_dict(NULL, in, out, in_size, out_size);
+}
 
+BZIP3_API struct bz3_ctx * bz3_ctx_new(void) {
+    struct bz3_ctx * ctx = malloc(sizeof(struct bz3_ctx));
+    if (!ctx) return NULL;
+    memset(ctx, 0, sizeof(struct bz3_ctx));
+    return ctx;
+}
+
+BZIP3_API void bz3_ctx_free(struct bz3_ctx * ctx) {
+    if (!ctx) return;
+    ctx_release(ctx);
+    free(ctx);
+}
+
+BZIP3_API int bz3_ctx_set_dict(struct bz3_ctx * ctx, const struct bz3_dict * dict) {
+    ctx->dict = dict;
     return BZ3_OK;
 }
 
-BZIP3_API size_t bz3_min_memory_needed(int32_t block_size) {
-    if (block_size < KiB(65) || block_size > MiB(511)) {
-        return 0;
+BZIP3_API int bz3_ctx_set_small_blocks(struct bz3_ctx * ctx, int enable) {
+    ctx->small_blocks = enable != 0;
+    return BZ3_OK;
+}
+
+BZIP3_API int bz3_compress_ctx(struct bz3_ctx * ctx, u32 block_size, const u8 * in, u8 * out, size_t in_size,
+                               size_t * out_size) {
+    return compress_frame(ctx, block_size, in, out, in_size, out_size);
+}
+
+BZIP3_API int bz3_decompress_ctx(struct bz3_ctx * ctx, const u8 * in, u8 * out, size_t in_size, size_t * out_size) {
+    return decompress_frame(ctx, in, out, in_size, out_size);
+}
+
+/* Worker threads. The calling thread is the first worker; should a thread fail to start, the others pick up its
+   share of the work. Every worker has a context of its own. */
+
+struct worker {
+    void * job;
+    struct bz3_ctx * ctx;
+};
+
+static void run_workers(void * (*work)(void *), void * job, struct bz3_ctx * ctx, s32 workers) {
+    if (workers < 1) return;
+    struct worker worker[workers];
+    for (s32 t = 0; t < workers; t++) {
+        worker[t].job = job;
+        worker[t].ctx = &ctx[t];
     }
 
-    size_t total_size = 0;
+#ifdef PTHREAD
+    pthread_t threads[workers];
+    s32 started = 1;
+    while (started < workers && !pthread_create(&threads[started], NULL, work, &worker[started])) started++;
+    work(&worker[0]);
+    for (s32 t = 1; t < started; t++) pthread_join(threads[t], NULL);
+#else
+    work(&worker[0]);
+#endif
+}
+
+/* Batches. Every worker thread runs on a context of its own, which the batch keeps from one call to the next. The
+   items are handed out biggest first, one at a time, so that the workers finish at about the same time even when
+   the sizes vary a lot. */
 
-    // This is based on bz3_new.
-    // Core state structure
-    total_size += sizeof(struct bz3_state);
+struct bz3_batch {
+    s32 threads;
+    struct bz3_ctx ctx[];
+};
+
+struct batch_item {
+    size_t size, index;
+};
+
+struct batch_job {
+    int decode;
+    u32 block_size;
+    size_t n, next;
+    const struct batch_item * order;
+    const u8 * const * in;
+    const size_t * in_sizes;
+    u8 * const * out;
+    size_t * out_sizes;
+    int * status;
+#ifdef PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+static int batch_item_cmp(const void * a, const void * b) {
+    const struct batch_item *x = a, *y = b;
+    if (x->size != y->size) return x->size < y->size ? 1 : -1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void * batch_work(void * _worker) {
+    struct worker * worker = _worker;
+    struct batch_job * job = worker->job;
+
+    for (;;) {
+#ifdef PTHREAD
+        pthread_mutex_lock(&job->lock);
+#endif
+        size_t k = job->next < job->n ? job->next++ : job->n;
+#ifdef PTHREAD
+        pthread_mutex_unlock(&job->lock);
+#endif
+        if (k == job->n) break;
+
+        size_t i = job->order[k].index;
+        size_t * out_size = &job->out_sizes[i];
+        if (job->decode)
+            job->status[i] = decompress_frame(worker->ctx, job->in[i], job->out[i], job->in_sizes[i], out_size);
+        else
+            job->status[i] =
+                compress_frame(worker->ctx, job->block_size, job->in[i], job->out[i], job->in_sizes[i], out_size);
+    }
+
+    return NULL;
+}
+
+static int batch_run(struct bz3_batch * batch, struct batch_job * job) {
+    struct batch_item * order = malloc(job->n * sizeof(struct batch_item) + 1);
+    if (!order) {
+        for (size_t i = 0; i < job->n; i++) job->status[i] = BZ3_ERR_INIT;
+        return BZ3_ERR_INIT;
+    }
+    for (size_t i = 0; i < job->n; i++) {
+        order[i].size = job->in_sizes[i];
+        order[i].index = i;
+    }
+    qsort(order, job->n, sizeof(struct batch_item), batch_item_cmp);
+    job->order = order;
+    job->next = 0;
+
+    s32 workers = (size_t)batch->threads < job->n ? batch->threads : (s32)job->n;
+#ifdef PTHREAD
+    pthread_mutex_init(&job->lock, NULL);
+#endif
+    run_workers(batch_work, job, batch->ctx, workers);
+#ifdef PTHREAD
+    pthread_mutex_destroy(&job->lock);
+#endif
+
+    free(order);
+
+    for (size_t i = 0; i < job->n; i++)
+        if (job->status[i] != BZ3_OK) return job->status[i];
+    return BZ3_OK;
+}
+
+BZIP3_API struct bz3_batch * bz3_batch_new(s32 threads) {
+    if (threads < 1) return NULL;
+#ifndef PTHREAD
+    threads = 1;
+#endif
+    struct bz3_batch * batch = malloc(sizeof(struct bz3_batch) + threads * sizeof(struct bz3_ctx));
+    if (!batch) return NULL;
+    batch->threads = threads;
+    memset(batch->ctx, 0, threads * sizeof(struct bz3_ctx));
+    return batch;
+}
+
+BZIP3_API void bz3_batch_free(struct bz3_batch * batch) {
+    if (!batch) return;
+    for (s32 t = 0; t < batch->threads; t++) ctx_release(&batch->ctx[t]);
+    free(batch);
+}
+
+BZIP3_API int bz3_batch_set_dict(struct bz3_batch * batch, const struct bz3_dict * dict) {
+    for (s32 t = 0; t < batch->threads; t++) batch->ctx[t].dict = dict;
+    return BZ3_OK;
+}
+
+BZIP3_API int bz3_batch_set_small_blocks(struct bz3_batch * batch, int enable) {
+    for (s32 t = 0; t < batch->threads; t++) bz3_ctx_set_small_blocks(&batch->ctx[t], enable);
+    return BZ3_OK;
+}
+
+BZIP3_API int bz3_batch_compress(struct bz3_batch * batch, u32 block_size, size_t n, const u8 * const in[],
+                                 const size_t in_sizes[], u8 * const out[], size_t out_sizes[], int status[]) {
+    struct batch_job job;
+    job.decode = 0;
+    job.block_size = block_size;
+    job.n = n;
+    job.in = in;
+    job.in_sizes = in_sizes;
+    job.out = out;
+    job.out_sizes = out_sizes;
+    job.status = status;
+    return batch_run(batch, &job);
+}
+
+BZIP3_API int bz3_batch_decompress(struct bz3_batch * batch, size_t n, const u8 * const in[], const size_t in_sizes[],
+                                   u8 * const out[], size_t out_sizes[], int status[]) {
+    struct batch_job job;
+    job.decode = 1;
+    job.block_size = 0;
+    job.n = n;
+    job.in = in;
+    job.in_sizes = in_sizes;
+    job.out = out;
+    job.out_sizes = out_sizes;
+    job.status = status;
+    return batch_run(batch, &job);
+}
+
+/* Multi-threaded frames. Blocks are handed out in order to workers with a state of their own. An encoded block
+   can only take its place in the output once the sizes of the ones before it are known, so the workers take turns
+   at that, and copy the block over themselves. The chunk headers of a frame give all of its offsets up front, which
+   lets the decoders write their blocks out in any order. Errors are reported for the first block that fails, so
+   the outcome is the same as with one thread. */
+
+#ifdef PTHREAD
+
+struct frame_block {
+    size_t in_offset, out_offset;
+    s32 size, orig_size;
+};
+
+struct frame_job {
+    const u8 * in;
+    u8 * out;
+    size_t in_size, buf_max, out_size;
+    u32 block_size, n_blocks, next, placed, failed;
+    int with_dict, error;
+    const struct frame_block * blocks;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+};
+
+static void * encode_frame_work(void * _worker) {
+    struct worker * worker = _worker;
+    struct frame_job * job = worker->job;
+    struct bz3_ctx * ctx = worker->ctx;
+    int error = ctx_reserve(ctx, job->block_size, 0);
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        if (job->error != BZ3_OK || job->next == job->n_blocks) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        u32 i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        size_t in_offset = (size_t)i * job->block_size;
+        s32 size = i == job->n_blocks - 1 ? job->in_size - in_offset : job->block_size;
+        s32 out_size_block = 0;
+        if (error == BZ3_OK) {
+            memcpy(ctx->buffer, job->in + in_offset, size);
+            out_size_block = bz3_encode_block(ctx->state, ctx->buffer, size);
+            error = bz3_last_error(ctx->state);
+        }
+
+        // Wait for the previous block to take its place.
+        pthread_mutex_lock(&job->lock);
+        while (job->placed != i && job->error == BZ3_OK) pthread_cond_wait(&job->turn, &job->lock);
+        size_t offset = job->out_size;
+        if (job->error == BZ3_OK) {
+            if (error == BZ3_OK && offset + 8 + out_size_block > job->buf_max) error = BZ3_ERR_DATA_TOO_BIG;
+            if (error != BZ3_OK) {
+                job->error = error;
+            } else {
+                job->out_size += out_size_block + 8;
+                job->placed++;
+            }
+            pthread_cond_broadcast(&job->turn);
+        } else {
+            error = job->error;
+        }
+        pthread_mutex_unlock(&job->lock);
+        if (error != BZ3_OK) break;
+
+        memcpy(job->out + offset + 8, ctx->buffer, out_size_block);
+        write_neutral_s32(job->out + offset, out_size_block);
+        write_neutral_s32(job->out + offset + 4, size);
+    }
+
+    return NULL;
+}
+
+static void * decode_frame_work(void * _worker) {
+    struct worker * worker = _worker;
+    struct frame_job * job = worker->job;
+    struct bz3_ctx * ctx = worker->ctx;
+    int error = ctx_reserve(ctx, job->block_size, 1);
+    if (error == BZ3_OK && !job->with_dict) bz3_set_dict(ctx->state, NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        // Blocks past one that failed are of no use.
+        const int done = job->next >= job->failed;
+        u32 i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (done) break;
+
+        // The space past the block belongs to the other workers, so the block has to decode within its own.
+        const struct frame_block * block = &job->blocks[i];
+        if (error == BZ3_OK) {
+            const u8 * data = job->in + block->in_offset;
+            u8 * slot = job->out + block->out_offset;
+            decode_block(ctx->state, data, slot, block->orig_size, block->size, block->orig_size);
+            if (ctx->state->last_error != BZ3_OK) {
+                decode_block(ctx->state, data, ctx->buffer, ctx->buffer_size, block->size, block->orig_size);
+                if (ctx->state->last_error == BZ3_OK) memcpy(slot, ctx->buffer, block->orig_size);
+            }
+            error = bz3_last_error(ctx->state);
+        }
+        if (error != BZ3_OK) {
+            pthread_mutex_lock(&job->lock);
+            if (i < job->failed) {
+                job->failed = i;
+                job->error = error;
+            }
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
 
-    // cm_state
-    total_size += sizeof(state);
+    return NULL;
+}
 
-    // Swap buffer (needs to handle expanded size) (swap_buffer)
-    total_size += bz3_bound(block_size);
+static int compress_frame_mt(struct bz3_ctx * ctx, s32 threads, u32 block_size, const u8 * in, u8 * out,
+                             size_t in_size, size_t * out_size) {
+    const u32 frame_block = frame_block_size(block_size, in_size, ctx->small_blocks);
+    u32 n_blocks = in_size / frame_block;
+    if (in_size % frame_block) n_blocks++;
+    if ((u32)threads > n_blocks) threads = n_blocks;
+    if (threads <= 1) return compress_frame(ctx, block_size, in, out, in_size, out_size);
+
+    const size_t header_size = ctx->dict ? 17 : 13;
+    struct frame_job job;
+    job.buf_max = *out_size;
+    *out_size = 0;
+    if (job.buf_max < header_size || job.buf_max < bz3_bound(in_size)) return BZ3_ERR_DATA_TOO_BIG;
+
+    job.in = in;
+    job.out = out;
+    job.in_size = in_size;
+    job.out_size = write_frame_header(out, frame_block, n_blocks, ctx->dict);
+    job.block_size = frame_block;
+    job.n_blocks = n_blocks;
+    job.next = job.placed = 0;
+    job.error = BZ3_OK;
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.turn, NULL);
+    // The workers all go by the dictionary of the first context.
+    for (s32 t = 1; t < threads; t++) ctx[t].dict = ctx->dict;
+    run_workers(encode_frame_work, &job, ctx, threads);
+    pthread_cond_destroy(&job.turn);
+    pthread_mutex_destroy(&job.lock);
+
+    *out_size = job.out_size;
+    return job.error;
+}
 
-    // SAIS array
-    total_size += BWT_BOUND(block_size) * sizeof(int32_t);
+static int decompress_frame_mt(struct bz3_ctx * ctx, s32 threads, const u8 * in, u8 * out, size_t in_size,
+                               size_t * out_size) {
+    u32 block_size, n_blocks;
+    size_t header_size;
+    int error = read_frame_header(ctx, in, in_size, &block_size, &n_blocks, &header_size);
+    if (error != BZ3_OK) return error;
+    if ((u32)threads > n_blocks) threads = n_blocks;
+    if (threads <= 1) return decompress_frame(ctx, in, out, in_size, out_size);
+
+    // Every chunk takes at least 8 bytes, which bounds the number of them on hand.
+    size_t max_blocks = (in_size - header_size) / 8;
+    if (max_blocks > n_blocks) max_blocks = n_blocks;
+    struct frame_block * blocks = malloc(max_blocks * sizeof(struct frame_block) + 1);
+    if (!blocks) return BZ3_ERR_INIT;
+
+    // Lay out the blocks. The checks are those of `decompress_frame()'; past the first chunk that fails them, only
+    // the blocks before it get decoded.
+    size_t buf_max = *out_size, in_offset = header_size, out_offset = 0;
+    u32 valid = 0;
+    for (; valid < n_blocks; valid++) {
+        size_t left = in_size - in_offset;
+        if (left < 8) {
+            error = BZ3_ERR_MALFORMED_HEADER;
+            break;
+        }
+        s32 size = read_neutral_s32(in + in_offset);
+        if (size < 0 || (size_t)size > bz3_bound(block_size)) {
+            error = BZ3_ERR_MALFORMED_HEADER;
+            break;
+        }
+        if (left < (size_t)size + 8) {
+            error = BZ3_ERR_TRUNCATED_DATA;
+            break;
+        }
+        s32 orig_size = read_neutral_s32(in + in_offset + 4);
+        if (orig_size < 0) {
+            error = BZ3_ERR_MALFORMED_HEADER;
+            break;
+        }
+        if (buf_max < out_offset + orig_size) {
+            error = BZ3_ERR_DATA_TOO_BIG;
+            break;
+        }
+        blocks[valid].in_offset = in_offset + 8;
+        blocks[valid].out_offset = out_offset;
+        blocks[valid].size = size;
+        blocks[valid].orig_size = orig_size;
+        in_offset += (size_t)size + 8;
+        out_offset += orig_size;
+    }
+
+    struct frame_job job;
+    job.in = in;
+    job.out = out;
+    job.block_size = block_size;
+    job.n_blocks = valid;
+    job.next = 0;
+    job.failed = valid;
+    job.with_dict = header_size == 17;
+    job.error = BZ3_OK;
+    job.blocks = blocks;
+
+    if ((u32)threads > valid) threads = valid;
+    pthread_mutex_init(&job.lock, NULL);
+    for (s32 t = 1; t < threads; t++) ctx[t].dict = ctx->dict;
+    run_workers(decode_frame_work, &job, ctx, threads);
+    pthread_mutex_destroy(&job.lock);
+
+    if (job.failed < valid) {
+        out_offset = blocks[job.failed].out_offset;
+        error = job.error;
+    }
+    free(blocks);
+    *out_size = out_offset;
+    return error;
+}
+
+#endif
+
+BZIP3_API int bz3_compress_mt(u32 block_size, s32 threads, const u8 * in, u8 * out, size_t in_size,
+                              size_t * out_size) {
+    if (threads < 1) return BZ3_ERR_INIT;
+#ifdef PTHREAD
+    struct bz3_ctx * ctx = calloc(threads, sizeof(struct bz3_ctx));
+    if (!ctx) return BZ3_ERR_INIT;
+    int error = compress_frame_mt(ctx, threads, block_size, in, out, in_size, out_size);
+    for (s32 t = 0; t < threads; t++) ctx_release(&ctx[t]);
+    free(ctx);
+    return error;
+#else
+    return bz3_compress(block_size, in, out, in_size, out_size);
+#endif
+}
+
+BZIP3_API int bz3_decompress_mt(s32 threads, const u8 * in, u8 * out, size_t in_size, size_t * out_size) {
+    if (threads < 1) return BZ3_ERR_INIT;
+#ifdef PTHREAD
+    struct bz3_ctx * ctx = calloc(threads, sizeof(struct bz3_ctx));
+    if (!ctx) return BZ3_ERR_INIT;
+    int error = decompress_frame_mt(ctx, threads, in, out, in_size, out_size);
+    for (s32 t = 0; t < threads; t++) ctx_release(&ctx[t]);
+    free(ctx);
+    return error;
+#else
+    return bz3_decompress(in, out, in_size, out_size);
+#endif
+}
+
+BZIP3_API size_t bz3_min_memory_needed_flags(int32_t block_size, int32_t flags) {
+    if (block_size < 1 || block_size > MiB(511)) {
+        return 0;
+    }
+
+    // Every allocation is rounded up as bz3_new_workspace does, which also needs room to align the workspace and
+    // to keep its cursor.
+    size_t total_size = WORKSPACE_ALIGN - 1 + workspace_round(sizeof(struct workspace));
+
+    // This is based on bz3_new_ex.
+    // Core state structure
+    total_size += workspace_round(sizeof(struct bz3_state));
+
+    // cm_state, and the APM of the strong coder, which is taken from the workspace once a block needs it
+    total_size += workspace_round(sizeof(state));
+    total_size += workspace_round(STRONG_APM_SIZE);
+
+    // Swap buffer (needs to handle expanded size) (swap_buffer), unless the SAIS array stands in for it
+    if ((flags & BZ3_FLAG_LOW_MEMORY) || !(flags & BZ3_FLAG_IN_PLACE)) total_size += workspace_round(bz3_bound(block_size));
+
+    if (flags & BZ3_FLAG_LOW_MEMORY) {
+        // Sampled occurrence table (occ_super, occ_blocks)
+        total_size += workspace_round(occ_super_size(bz3_bound(block_size)));
+        total_size += workspace_round(occ_blocks_size(bz3_bound(block_size)));
+    } else {
+        // SAIS array
+        total_size += workspace_round(BWT_BOUND(block_size) * sizeof(int32_t));
+    }
 
     // LZP lookup table (lzp_lut)
-    total_size += (1 << LZP_DICTIONARY) * sizeof(int32_t);
+    total_size += workspace_round((1 << lzp_state_bits(block_size)) * sizeof(int32_t));
     return total_size;
 }
 
+BZIP3_API size_t bz3_min_memory_needed(int32_t block_size) { return bz3_min_memory_needed_flags(block_size, 0); }
+
+BZIP3_API s32 bz3_plan_workers(size_t memory_budget, s32 block_size, s32 max_workers, s32 * flags) {
+    // Configurations trading speed for memory, fastest first.
+    static const s32 configs[] = { 0, BZ3_FLAG_IN_PLACE, BZ3_FLAG_LOW_MEMORY };
+    const s32 memory_flags = BZ3_FLAG_IN_PLACE | BZ3_FLAG_LOW_MEMORY;
+    s32 base = *flags & ~memory_flags, allowed = *flags & memory_flags, best = 0;
+
+    if (max_workers < 1) return 0;
+
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        if ((configs[i] & allowed) != configs[i]) continue;
+
+        size_t per_worker = bz3_min_memory_needed_flags(block_size, base | configs[i]);
+        if (!per_worker) return 0;
+        // Every worker also needs a buffer to hold the block it is processing.
+        per_worker += bz3_bound(block_size);
+
+        size_t fit = memory_budget / per_worker;
+        s32 workers = fit < (size_t)max_workers ? (s32)fit : max_workers;
+        if (workers > best) {
+            best = workers;
+            *flags = base | configs[i];
+        }
+    }
+
+    return best;
+}
+
+#ifdef __linux__
+/* Whether `name' is one of the comma separated controllers in `list'. */
+static int has_controller(const char * list, const char * name) {
+    size_t length = strlen(name);
+    for (const char * c = list; c; c = strchr(c, ',') ? strchr(c, ',') + 1 : NULL)
+        if (!strncmp(c, name, length) && (c[length] == ',' || !c[length])) return 1;
+    return 0;
+}
+
+/* Find the path of the cgroup of this process, as listed in /proc/self/cgroup: in the cgroup v2 hierarchy if
+   `controller' is NULL, and in the v1 hierarchy of that controller otherwise. */
+static int cgroup_path(const char * controller, char * path, size_t size) {
+    char line[PATH_MAX + 64];
+    int found = 0;
+    FILE * f = fopen("/proc/self/cgroup", "r");
+    if (!f) return 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        // Lines read `id:controllers:path'; v2 has the id 0 and no controllers.
+        char *controllers = strchr(line, ':'), *rest;
+        if (!controllers || !(rest = strchr(++controllers, ':'))) continue;
+        *rest++ = 0;
+        if (controller ? !has_controller(controllers, controller) : *controllers || strncmp(line, "0:", 2)) continue;
+        rest[strcspn(rest, "\n")] = 0;
+        // The root cgroup is reported as `/'; strip it so that paths can be appended as-is.
+        if (!strcmp(rest, "/")) *rest = 0;
+        if (strlen(rest) >= size) continue;
+        strcpy(path, rest);
+        found = 1;
+    }
+    fclose(f);
+    return found;
+}
+
+/* Read up to two numbers from the file `name' of the cgroup directory `dir'. Returns how many were read: none for
+   `max', which is how cgroup v2 spells out that there is no limit. */
+static int cgroup_read(const char * dir, const char * name, long long * a, long long * b) {
+    char file[PATH_MAX + 128];
+    snprintf(file, sizeof(file), "%s/%s", dir, name);
+    FILE * f = fopen(file, "r");
+    if (!f) return 0;
+    int n = fscanf(f, "%lld %lld", a, b);
+    fclose(f);
+    return n < 0 ? 0 : n;
+}
+
+static u64 memory_limit_v2(const char * dir) {
+    long long limit, unused;
+    return cgroup_read(dir, "memory.max", &limit, &unused) >= 1 && limit > 0 ? (u64)limit : 0;
+}
+
+static u64 memory_limit_v1(const char * dir) {
+    long long limit, unused;
+    // Unlimited groups read a huge page-aligned number.
+    if (cgroup_read(dir, "memory.limit_in_bytes", &limit, &unused) < 1 || limit <= 0) return 0;
+    return (u64)limit < (UINT64_C(1) << 60) ? (u64)limit : 0;
+}
+
+/* The smallest limit that `limit' finds in the cgroup at `path' under the hierarchy mounted at `root' and in its
+   ancestors, or 0 if none of them has one. `path' is cut back to the root on the way. */
+static u64 cgroup_min(const char * root, char * path, u64 (*limit)(const char *)) {
+    char dir[PATH_MAX + 64];
+    u64 min = 0;
+
+    while (1) {
+        snprintf(dir, sizeof(dir), "%s%s", root, path);
+        u64 value = limit(dir);
+        if (value && (!min || value < min)) min = value;
+
+        char * slash = strrchr(path, '/');
+        if (!slash) break;
+        *slash = 0;
+    }
+
+    return min;
+}
+
+/* The limit of the control group of this process and its ancestors, read by `v2' on cgroup v2 and, failing that, by
+   `v1' in the v1 hierarchy of `controller', where each controller is mounted on its own. 0 if there is none. */
+static u64 cgroup_limit(const char * controller, u64 (*v2)(const char *), u64 (*v1)(const char *)) {
+    char path[PATH_MAX], root[64];
+    u64 limit = 0;
+    if (cgroup_path(NULL, path, sizeof(path))) limit = cgroup_min("/sys/fs/cgroup", path, v2);
+    snprintf(root, sizeof(root), "/sys/fs/cgroup/%s", controller);
+    if (!limit && cgroup_path(controller, path, sizeof(path))) limit = cgroup_min(root, path, v1);
+    return limit;
+}
+#endif
+
+BZIP3_API size_t bz3_memory_limit(void) {
+#ifdef __linux__
+    u64 limit = cgroup_limit("memory", memory_limit_v2, memory_limit_v1);
+    return limit > SIZE_MAX ? SIZE_MAX : (size_t)limit;
+#else
+    return 0;
+#endif
+}
+
+#ifdef PTHREAD
+    #ifdef __linux__
+/* A quota of `quota' microseconds every `period' in whole CPUs, rounded up, or 0 for none. */
+static u64 whole_cpus(long long quota, long long period) {
+    return quota > 0 && period > 0 ? (u64)((quota + period - 1) / period) : 0;
+}
+
+static u64 cpu_limit_v2(const char * dir) {
+    long long quota, period;
+    return cgroup_read(dir, "cpu.max", &quota, &period) == 2 ? whole_cpus(quota, period) : 0;
+}
+
+static u64 cpu_limit_v1(const char * dir) {
+    long long quota, period, unused;
+    // No quota reads -1.
+    if (cgroup_read(dir, "cpu.cfs_quota_us", &quota, &unused) < 1 || quota <= 0) return 0;
+    return cgroup_read(dir, "cpu.cfs_period_us", &period, &unused) >= 1 ? whole_cpus(quota, period) : 0;
+}
+    #endif
+
+/* The CPUs this process may run on. */
+static s32 available_cpus(void) {
+    s32 cpus = 0;
+    #if defined(__linux__)
+    cpu_set_t set;
+    if (!sched_getaffinity(0, sizeof(set), &set)) cpus = CPU_COUNT(&set);
+    #endif
+    #ifdef _SC_NPROCESSORS_ONLN
+    if (cpus < 1) cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    #endif
+    if (cpus < 1) cpus = 1;
+    #ifdef __linux__
+    u64 quota = cgroup_limit("cpu", cpu_limit_v2, cpu_limit_v1);
+    if (quota && quota < (u64)cpus) cpus = (s32)quota;
+    #endif
+    return cpus;
+}
+#else
+static s32 available_cpus(void) { return 1; }
+#endif
+
+BZIP3_API s32 bz3_auto_threads(size_t in_size, s32 block_size) {
+    s32 threads = available_cpus();
+    if (in_size && block_size > 0) {
+        size_t blocks = (in_size - 1) / (size_t)block_size + 1;
+        if (blocks < (size_t)threads) threads = (s32)blocks;
+    }
+    return threads;
+}
+
+// Below level 1's block size, the ratio drops quickly: on mixed text and binaries, 4MiB blocks come out 6% larger
+// than 16MiB ones, but 1MiB blocks are 22% larger. See etc/BENCHMARKS.md.
+#define SPLIT_FLOOR MiB(4)
+
+BZIP3_API s32 bz3_split_block_size(size_t in_size, s32 block_size, s32 blocks) {
+    if (blocks <= 1 || block_size <= SPLIT_FLOOR || !in_size) return block_size;
+    size_t split = (in_size - 1) / (size_t)blocks + 1;
+    split = (split + KiB(64) - 1) / KiB(64) * KiB(64);
+    if (split < SPLIT_FLOOR) split = SPLIT_FLOOR;
+    return split < (size_t)block_size ? (s32)split : block_size;
+}
 
 BZIP3_API int bz3_orig_size_sufficient_for_decode(const u8 * block, size_t block_size, s32 orig_size) {
     // Need at least 9 bytes for the initial header (4 bytes BWT index + 4 bytes CRC + 1 byte model)
@@ -1035,7 +3148,7 @@ BZIP3_API int bz3_orig_size_sufficient_for_decode(const u8 * block, size_t block
         return 1;  
     }
 
-    s8 model = block[8];
+    u8 model = block[8];
     s32 lzp_size = -1, rle_size = -1;
     size_t header_size = 9;  // Start after model byte
 
@@ -17,7 +17,12 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+    #define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -25,8 +30,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+    #include <fcntl.h>
+#endif
+
+#ifdef PTHREAD
+    #include <pthread.h>
+#endif
+
+#if defined(PTHREAD) && !defined(_WIN32)
+    #define BATCH_SIGNALS
+    #include <signal.h>
+#endif
+
+#if defined(__linux__) && defined(PTHREAD)
+    #define NUMA_PLACEMENT
+    #include <sched.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <sys/syscall.h>
+        #ifdef __NR_io_uring_setup
+            #define IO_URING
+            #include <fcntl.h>
+            #include <linux/io_uring.h>
+            #include <sys/mman.h>
+            #include <sys/uio.h>
+        #endif
+    #endif
+#endif
+
 #if defined __MSVCRT__
     #include <fcntl.h>
     #include <io.h>
@@ -41,6 +79,28 @@
 #define MODE_TEST 2
 #define MODE_RECOVER 3
 
+/* -j auto */
+#define JOBS_AUTO -1
+
+#ifdef PTHREAD
+/* Set by --split. */
+static int split;
+#endif
+
+/* Set by --ramp. */
+static int ramp;
+
+/* Set by --memlimit. The limit of the control group, the default, only ever lowers the amount of jobs. */
+static int memlimit_given;
+
+/* The size of block number `block' of a stream being compressed. With --ramp, the first blocks are 256KiB, 1MiB and
+   4MiB, so that a decoder writing to a pipe can start on its output before a whole block of the full size is in. */
+static s32 ramp_block_size(s32 block_size, uint64_t block) {
+    if (!ramp || block >= 3) return block_size;
+    s32 size = KiB(256) << 2 * block;
+    return size < block_size ? size : block_size;
+}
+
 static void version() {
     fprintf(stdout, "bzip3 " VERSION
                     "\n"
@@ -65,30 +125,491 @@ static void help() {
             "  -V, --version     display version information\n"
             "Extra flags:\n"
             "  -c, --stdout      force writing to standard output\n"
-            "  -b N, --block=N   set block size in MiB {16}\n"
+            "  -1 .. -9          set the compression level, fastest to strongest {5}\n"
+            "  -b N, --block=N   set block size in MiB {set by the level, 16}\n"
             "  -B, --batch       process all files specified as inputs\n"
+            "  -R, --recursive   process the files in the directories given (implies -B)\n"
+            "      --lowmem      decompress using less memory, at reduced speed\n"
+            "      --memlimit=N  limit memory usage to N MiB {cgroup limit, if any}\n"
+            "      --train=DICT  train a dictionary for the API on the sample files given\n"
+            "      --sync=MODE   sync outputs: `always', `deferred' to the end or `none' {always}\n"
+            "      --ramp        start with small blocks, for decoders streaming the output\n"
 #ifdef PTHREAD
-            "  -j N, --jobs=N    set the amount of parallel threads\n"
+            "  -j N, --jobs=N    set the amount of parallel threads, or `auto' for the CPUs available\n"
+            "      --split       use smaller blocks, down to 4 MiB, to give every job one\n"
+#endif
+#ifdef NUMA_PLACEMENT
+            "      --numa        spread the jobs over NUMA nodes, keeping memory local\n"
+#endif
+#ifdef IO_URING
+            "      --io=ENGINE   read and write files with `stdio', `uring' or `direct' {stdio}\n"
+#endif
+#ifdef __linux__
+            "      --nocache     drop the files from the page cache as they are processed\n"
 #endif
             "\n"
             "Report bugs to: https://github.com/kspalaiologos/bzip3\n");
 }
 
+#define IO_STDIO 0
+#define IO_URING_ENGINE 1
+#define IO_DIRECT 2
+
+struct uring_file;
+
+/* The named regular files open for reading and writing; batch mode keeps several of them open at a time. Pipes and the
+   standard streams are not in here. */
+static struct file_stream {
+    struct file_stream * next;
+    FILE * des;
+    int fd, writing;
+    off_t pos;     /* bytes passed through xread or xwrite */
+    off_t flushed; /* --nocache: write-back started up to here */
+    off_t dropped; /* --nocache: dropped from the page cache up to here */
+    int reserved;  /* preallocated past the end, to be cut back to `pos' on close */
+    struct uring_file * uring;
+} * streams;
+
+static struct file_stream * find_stream(FILE * des) {
+    for (struct file_stream * s = streams; s != NULL; s = s->next)
+        if (des != NULL && s->des == des) return s;
+    return NULL;
+}
+
+static struct file_stream * add_stream(FILE * des, int fd, int writing) {
+    struct file_stream * s = calloc(1, sizeof(struct file_stream));
+    if (s == NULL) return NULL;
+    s->des = des;
+    s->fd = fd;
+    s->writing = writing;
+    s->next = streams;
+    streams = s;
+    return s;
+}
+
+static void remove_stream(FILE * des) {
+    for (struct file_stream ** p = &streams; *p != NULL; p = &(*p)->next) {
+        if ((*p)->des == des) {
+            struct file_stream * s = *p;
+            *p = s->next;
+            free(s);
+            return;
+        }
+    }
+}
+
+#ifdef IO_URING
+/* The io_uring engine (--io=uring) keeps URING_DEPTH chunks of a regular file in flight: reads run ahead of the block
+   loop and writes trail behind it, so the disk works while the blocks are being coded. The chunks are registered with
+   the ring when the kernel allows it; without a ring, the same chunks go through plain pread and pwrite. With
+   --io=direct, the file is opened with O_DIRECT, which the page aligned chunks and offsets allow; only the last write
+   is padded to the alignment, and the file is cut back to its length after it. */
+#define URING_DEPTH 4
+#define URING_CHUNK MiB(4)
+#define URING_ALIGN 4096
+
+struct uring_chunk {
+    u8 * buf;
+    size_t len; /* bytes read into buf, or queued in it for writing */
+    size_t pos; /* bytes of buf already handed to the reader */
+    off_t offset;
+    int busy;
+    ssize_t res;
+};
+
+struct uring_file {
+    int fd, writing, direct, eof, ring, fixed, head;
+    off_t offset;
+    unsigned *sq_tail, *sq_array, *cq_head, *cq_tail, sq_mask, cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    struct uring_chunk chunk[URING_DEPTH];
+};
+
+static void uring_teardown(struct uring_file * f) {
+    if (f->ring < 0) return;
+    munmap(f->sqes, f->sqes_size);
+    if (f->cq_ring != f->sq_ring) munmap(f->cq_ring, f->cq_ring_size);
+    munmap(f->sq_ring, f->sq_ring_size);
+    close(f->ring);
+    f->ring = -1;
+}
+
+static void uring_setup(struct uring_file * f) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    f->ring = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (f->ring < 0) {
+        f->ring = -1;
+        return;
+    }
+
+    f->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    f->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    f->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (f->cq_ring_size > f->sq_ring_size) f->sq_ring_size = f->cq_ring_size;
+        f->cq_ring_size = f->sq_ring_size;
+    }
+
+    f->sq_ring = mmap(NULL, f->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring,
+                      IORING_OFF_SQ_RING);
+    f->cq_ring = f->sqes = MAP_FAILED;
+    if (f->sq_ring != MAP_FAILED && (p.features & IORING_FEAT_SINGLE_MMAP))
+        f->cq_ring = f->sq_ring;
+    else if (f->sq_ring != MAP_FAILED)
+        f->cq_ring = mmap(NULL, f->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring,
+                          IORING_OFF_CQ_RING);
+    if (f->cq_ring != MAP_FAILED)
+        f->sqes = mmap(NULL, f->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring,
+                       IORING_OFF_SQES);
+    if (f->sqes == MAP_FAILED) {
+        if (f->cq_ring != MAP_FAILED && f->cq_ring != f->sq_ring) munmap(f->cq_ring, f->cq_ring_size);
+        if (f->sq_ring != MAP_FAILED) munmap(f->sq_ring, f->sq_ring_size);
+        close(f->ring);
+        f->ring = -1;
+        return;
+    }
+
+    u8 * sq = f->sq_ring, * cq = f->cq_ring;
+    f->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    f->sq_array = (unsigned *)(sq + p.sq_off.array);
+    f->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    f->cq_head = (unsigned *)(cq + p.cq_off.head);
+    f->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    f->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    f->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Registering the chunks saves the kernel from mapping them on every request. It can fail under a low
+       RLIMIT_MEMLOCK on older kernels, in which case the plain read and write opcodes are used. */
+    struct iovec iov[URING_DEPTH];
+    for (int i = 0; i < URING_DEPTH; i++) iov[i].iov_base = f->chunk[i].buf, iov[i].iov_len = URING_CHUNK;
+    f->fixed = syscall(__NR_io_uring_register, f->ring, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) == 0;
+}
+
+/* Transfer what is left of a chunk after `done' bytes synchronously. This finishes short transfers and redoes the
+   ones that io_uring failed or does not support; a read stops early only at the end of the file. */
+static ssize_t uring_finish(struct uring_file * f, struct uring_chunk * c, size_t done) {
+    size_t want = f->writing ? c->len : URING_CHUNK;
+    while (done < want) {
+        /* O_DIRECT reads end off the alignment only at the end of the file. */
+        if (f->direct && !f->writing && done % URING_ALIGN) break;
+        ssize_t n = f->writing ? pwrite(f->fd, c->buf + done, want - done, c->offset + done)
+                               : pread(f->fd, c->buf + done, want - done, c->offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) {
+            if (f->writing) return -EIO;
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static void uring_complete(struct uring_file * f, struct uring_chunk * c, ssize_t res) {
+    size_t want = f->writing ? c->len : URING_CHUNK;
+    if (res < 0 || (size_t)res < want) res = uring_finish(f, c, res < 0 ? 0 : res);
+    c->busy = 0;
+    c->res = res;
+    c->pos = 0;
+    c->len = f->writing || res < 0 ? 0 : res;
+}
+
+static void uring_submit(struct uring_file * f, int i) {
+    struct uring_chunk * c = &f->chunk[i];
+    c->busy = 1;
+    if (f->ring < 0) {
+        uring_complete(f, c, 0);
+        return;
+    }
+
+    unsigned tail = *f->sq_tail, index = tail & f->sq_mask;
+    struct io_uring_sqe * sqe = &f->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (f->writing)
+        sqe->opcode = f->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    else
+        sqe->opcode = f->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = f->fd;
+    sqe->addr = (uintptr_t)c->buf;
+    sqe->len = f->writing ? c->len : URING_CHUNK;
+    sqe->off = c->offset;
+    if (f->fixed) sqe->buf_index = i;
+    sqe->user_data = i;
+    f->sq_array[index] = index;
+    __atomic_store_n(f->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, f->ring, 1, 0, 0, NULL, 0) < 0) {
+        if (errno == EINTR) continue;
+        /* The entry never reached the kernel: take it back and do the transfer here instead. */
+        __atomic_store_n(f->sq_tail, tail, __ATOMIC_RELEASE);
+        uring_complete(f, c, 0);
+        return;
+    }
+}
+
+/* Reap completions until chunk `i' is idle. */
+static int uring_wait(struct uring_file * f, int i) {
+    while (f->chunk[i].busy) {
+        unsigned head = *f->cq_head;
+        if (head == __atomic_load_n(f->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, f->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+        struct io_uring_cqe * cqe = &f->cqes[head & f->cq_mask];
+        struct uring_chunk * c = &f->chunk[cqe->user_data];
+        ssize_t res = cqe->res;
+        __atomic_store_n(f->cq_head, head + 1, __ATOMIC_RELEASE);
+        uring_complete(f, c, res);
+    }
+    return 0;
+}
+
+static ssize_t uring_read(void * cookie, char * buf, size_t size) {
+    struct uring_file * f = cookie;
+    size_t done = 0;
+    while (done < size && !f->eof) {
+        struct uring_chunk * c = &f->chunk[f->head];
+        if (uring_wait(f, f->head)) return -1;
+        if (c->res < 0) {
+            errno = -c->res;
+            return -1;
+        }
+
+        size_t n = c->len - c->pos < size - done ? c->len - c->pos : size - done;
+        memcpy(buf + done, c->buf + c->pos, n);
+        c->pos += n;
+        done += n;
+
+        if (c->pos == c->len) {
+            if (c->len < URING_CHUNK) {
+                f->eof = 1;
+                break;
+            }
+            c->offset = f->offset;
+            f->offset += URING_CHUNK;
+            uring_submit(f, f->head);
+            f->head = (f->head + 1) % URING_DEPTH;
+        }
+    }
+    return done;
+}
+
+static void uring_flush(struct uring_file * f) {
+    struct uring_chunk * c = &f->chunk[f->head];
+    c->offset = f->offset;
+    f->offset += c->len;
+    if (f->direct && c->len % URING_ALIGN) {
+        size_t padded = (c->len + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+        memset(c->buf + c->len, 0, padded - c->len);
+        c->len = padded;
+    }
+    uring_submit(f, f->head);
+    f->head = (f->head + 1) % URING_DEPTH;
+}
+
+static ssize_t uring_write(void * cookie, const char * buf, size_t size) {
+    struct uring_file * f = cookie;
+    size_t done = 0;
+    while (done < size) {
+        struct uring_chunk * c = &f->chunk[f->head];
+        if (uring_wait(f, f->head)) return -1;
+        if (c->res < 0) {
+            errno = -c->res;
+            return -1;
+        }
+
+        size_t n = URING_CHUNK - c->len < size - done ? URING_CHUNK - c->len : size - done;
+        memcpy(c->buf + c->len, buf + done, n);
+        c->len += n;
+        done += n;
+        if (c->len == URING_CHUNK) uring_flush(f);
+    }
+    return done;
+}
+
+/* Wait for all the writes queued so far, reporting the first error. */
+static int uring_drain(struct uring_file * f) {
+    int error = 0;
+    if (f->writing && f->chunk[f->head].len && !f->chunk[f->head].busy) uring_flush(f);
+    for (int i = 0; i < URING_DEPTH; i++) {
+        if (uring_wait(f, i) && !error) error = errno;
+        if (f->writing && f->chunk[i].res < 0 && !error) error = -f->chunk[i].res;
+    }
+    if (f->writing && f->direct && !error && ftruncate(f->fd, f->offset)) error = errno;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_close(void * cookie) {
+    struct uring_file * f = cookie;
+    int error = uring_drain(f) ? errno : 0;
+
+    uring_teardown(f);
+    for (int i = 0; i < URING_DEPTH; i++) free(f->chunk[i].buf);
+    if (close(f->fd) && !error) error = errno;
+    free(f);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Open a regular file through the io_uring engine. Returns NULL for anything else (pipes, devices) or on failure, in
+   which case the caller opens the file with stdio. Without O_DIRECT support in the file system, `direct' is dropped. */
+static FILE * uring_open(const char * name, int writing, int direct) {
+    int flags = writing ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    int fd = open(name, flags | (direct ? O_DIRECT : 0), 0666);
+    if (fd < 0 && direct && errno == EINVAL) fd = open(name, flags, 0666), direct = 0;
+    if (fd < 0) return NULL;
+    struct stat st;
+    struct uring_file * f = NULL;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !(f = calloc(1, sizeof(struct uring_file)))) {
+        close(fd);
+        return NULL;
+    }
+    f->fd = fd;
+    f->writing = writing;
+    f->direct = direct;
+    f->ring = -1;
+    for (int i = 0; i < URING_DEPTH; i++) {
+        void * buf;
+        if (posix_memalign(&buf, URING_ALIGN, URING_CHUNK)) {
+            uring_close(f);
+            return NULL;
+        }
+        f->chunk[i].buf = buf;
+    }
+
+    uring_setup(f);
+    if (!writing) {
+        for (int i = 0; i < URING_DEPTH; i++) {
+            f->chunk[i].offset = f->offset;
+            f->offset += URING_CHUNK;
+            uring_submit(f, i);
+        }
+    }
+
+    cookie_io_functions_t funcs = { .read = uring_read, .write = uring_write, .seek = NULL, .close = uring_close };
+    FILE * des = fopencookie(f, writing ? "wb" : "rb", funcs);
+    struct file_stream * s = des != NULL ? add_stream(des, fd, writing) : NULL;
+    if (s == NULL) {
+        if (des != NULL)
+            fclose(des);
+        else
+            uring_close(f);
+        return NULL;
+    }
+    /* glibc feeds a cookie stream through its own buffer, a buffer at a time, so xread and xwrite look the engine up
+       in `streams' and hand it their block buffers directly. The stream itself is only used for feof and to close. */
+    setvbuf(des, NULL, _IONBF, 0);
+    s->uring = f;
+    return des;
+}
+#endif
+
+#ifdef __linux__
+/* Set by --nocache. */
+static int nocache;
+
+/* Reading or writing with --nocache drops what is done with from the page cache, a window at a time. Written data has
+   to reach the disk before it can be dropped: write-back of a window is started once it fills and waited for one
+   window later, so that the disk keeps up without stalling the writer. */
+#define NOCACHE_WINDOW MiB(8)
+
+/* Start or wait for write-back of a range. A failure here would not be reported again by fsync on this descriptor,
+   so it is fatal. */
+static void write_back(int fd, off_t offset, off_t length, unsigned flags) {
+    if (sync_file_range(fd, offset, length, flags) && errno != EINVAL && errno != ENOSYS) {
+        fprintf(stderr, "Write error: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void drop_behind(struct file_stream * s) {
+    off_t done = s->pos;
+#ifdef IO_URING
+    if (s->uring != NULL && s->uring->direct) return;
+    /* The engine may still be writing its last chunks. */
+    if (s->uring != NULL && s->writing) done -= URING_DEPTH * URING_CHUNK;
+#endif
+    if (!s->writing) {
+        if (done - s->dropped < NOCACHE_WINDOW) return;
+        posix_fadvise(s->fd, s->dropped, done - s->dropped, POSIX_FADV_DONTNEED);
+        s->dropped = done;
+        return;
+    }
+
+    if (done - s->flushed < NOCACHE_WINDOW) return;
+    write_back(s->fd, s->flushed, done - s->flushed, SYNC_FILE_RANGE_WRITE);
+    if (s->flushed > s->dropped) {
+        write_back(s->fd, s->dropped, s->flushed - s->dropped,
+                   SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(s->fd, s->dropped, s->flushed - s->dropped, POSIX_FADV_DONTNEED);
+        s->dropped = s->flushed;
+    }
+    s->flushed = done;
+}
+#endif
+
+static void advance_stream(struct file_stream * s, size_t bytes) {
+    if (s == NULL) return;
+    s->pos += bytes;
+#ifdef __linux__
+    if (nocache) drop_behind(s);
+#endif
+}
+
 static void xwrite(const void * data, size_t size, size_t len, FILE * des) {
     if (len == 0 || size == 0) return;
+    struct file_stream * s = find_stream(des);
+#ifdef IO_URING
+    if (s != NULL && s->uring != NULL) {
+        if (uring_write(s->uring, data, size * len) < 0) {
+            fprintf(stderr, "Write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        advance_stream(s, size * len);
+        return;
+    }
+#endif
     if (fwrite(data, size, len, des) != len) {
         fprintf(stderr, "Write error: %s\n", strerror(errno));
         exit(1);
     }
+    advance_stream(s, size * len);
 }
 
 /* Read any amount of items (from 0 to len) as long as there is no error */
 static size_t xread(void * data, size_t size, size_t len, FILE * des) {
+    struct file_stream * s = find_stream(des);
+#ifdef IO_URING
+    if (s != NULL && s->uring != NULL) {
+        ssize_t n = uring_read(s->uring, data, size * len);
+        if (n < 0) {
+            fprintf(stderr, "Read error: %s\n", strerror(errno));
+            exit(1);
+        }
+        /* Let stdio run into the end of the file as well, so that feof works. */
+        if ((size_t)n < size * len) getc(des);
+        advance_stream(s, n);
+        return n / size;
+    }
+#endif
     size_t written = fread(data, size, len, des);
     if (ferror(des)) {
         fprintf(stderr, "Read error: %s\n", strerror(errno));
         exit(1);
     }
+    advance_stream(s, written * size);
     return written;
 }
 
@@ -112,6 +633,75 @@ static void xread_noeof(void * data, size_t size, size_t len, FILE * des) {
     }
 }
 
+#define SYNC_ALWAYS 0
+#define SYNC_DEFERRED 1
+#define SYNC_NONE 2
+
+/* How the outputs are made durable, set by --sync. */
+static int sync_mode = SYNC_ALWAYS;
+
+/* The input files that --rm removes once the outputs are synced, with --sync=deferred. */
+static char ** pending_removals;
+static int n_pending_removals;
+
+#ifdef __linux__
+/* --sync=deferred keeps a descriptor for each file system written to and syncs each of them once at the end. The
+   descriptor is a dup of the first output on that file system, so syncfs (Linux 5.8 and later) reports the write-back
+   errors of every output written there since. */
+#define SYNC_MAX_FS 64
+
+static int deferred_fds[SYNC_MAX_FS];
+static dev_t deferred_devs[SYNC_MAX_FS];
+static int n_deferred;
+
+static void sync_fd(int fd) {
+    while (1) {
+        int status = fsync(fd);
+        if (status == -1) {
+            if (errno == EINVAL) break;
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: Failed on fsync: %s\n", strerror(errno));
+            exit(1);
+        }
+        break;
+    }
+}
+
+static void defer_sync(int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+        fprintf(stderr, "Error: Failed on fstat: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        sync_fd(fd);
+        return;
+    }
+    for (int i = 0; i < n_deferred; i++)
+        if (deferred_devs[i] == st.st_dev) return;
+
+    int copy = n_deferred < SYNC_MAX_FS ? dup(fd) : -1;
+    if (copy < 0) {
+        sync_fd(fd);
+        return;
+    }
+    deferred_fds[n_deferred] = copy;
+    deferred_devs[n_deferred++] = st.st_dev;
+}
+
+/* Sync the directory holding `path', so that a file renamed into it stays there. */
+static void sync_parent(const char * path) {
+    const char * slash = strrchr(path, '/');
+    char * dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    int fd = dir != NULL ? open(dir, O_RDONLY | O_DIRECTORY) : -1;
+    if (fd >= 0) {
+        sync_fd(fd);
+        close(fd);
+    }
+    free(dir);
+}
+#endif
+
 static void close_out_file(FILE * des) {
     if (des) {
         int outfd = fileno(des);
@@ -121,18 +711,34 @@ static void close_out_file(FILE * des) {
             exit(1);
         }
 
-#ifdef __linux__
-        while (1) {
-            int status = fsync(outfd);
-            if (status == -1) {
-                if (errno == EINVAL) break;
-                if (errno == EINTR) continue;
-                fprintf(stderr, "Error: Failed on fsync: %s\n", strerror(errno));
+        struct file_stream * s = find_stream(des);
+#ifdef IO_URING
+        if (s != NULL && s->uring != NULL) {
+            if (uring_drain(s->uring)) {
+                fprintf(stderr, "Write error: %s\n", strerror(errno));
                 exit(1);
             }
-            break;
+            outfd = s->fd;
         }
 #endif
+        /* The file is already `pos' bytes long: truncating it to that frees the blocks reserved past the end. */
+        if (s != NULL && s->reserved && ftruncate(outfd, s->pos)) {
+            fprintf(stderr, "Error: Failed on ftruncate: %s\n", strerror(errno));
+            exit(1);
+        }
+
+#ifdef __linux__
+        if (sync_mode == SYNC_ALWAYS)
+            sync_fd(outfd);
+        else if (sync_mode == SYNC_DEFERRED)
+            defer_sync(outfd);
+
+        if (s != NULL && nocache) {
+            write_back(outfd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(outfd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+#endif
+        remove_stream(des);
 
         if (des != stdout && fclose(des)) {
             fprintf(stderr, "Error: Failed on fclose: %s\n", strerror(errno));
@@ -141,6 +747,21 @@ static void close_out_file(FILE * des) {
     }
 }
 
+static void close_in_file(FILE * des) {
+#ifdef __linux__
+    struct file_stream * s = find_stream(des);
+    if (s != NULL && nocache) {
+#ifdef IO_URING
+        /* Let the reads still in flight land first, so that they are dropped as well. */
+        if (s->uring != NULL) uring_drain(s->uring);
+#endif
+        posix_fadvise(s->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+    remove_stream(des);
+    fclose(des);
+}
+
 static void remove_in_file(char * file_name, FILE * output_des) {
     if (file_name == NULL) {
         return;
@@ -148,14 +769,376 @@ static void remove_in_file(char * file_name, FILE * output_des) {
     if (output_des == stdout) {
         return;
     }
+    if (sync_mode == SYNC_DEFERRED) {
+        char ** removals = realloc(pending_removals, (n_pending_removals + 1) * sizeof(char *));
+        if (!removals) {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            exit(1);
+        }
+        pending_removals = removals;
+        pending_removals[n_pending_removals++] = file_name;
+        return;
+    }
     if (remove(file_name)) {
         fprintf(stderr, "Error: failed to remove input file `%s': %s\n", file_name, strerror(errno));
         exit(1);
     }
 }
 
-static int process(FILE * input_des, FILE * output_des, int mode, int block_size, int workers, int verbose,
-                   char * file_name) {
+/* Sync the outputs left for later by --sync=deferred, and only then remove the inputs they were made from. */
+static void finish_sync(void) {
+#ifdef __linux__
+    for (int i = 0; i < n_deferred; i++) {
+        while (syncfs(deferred_fds[i])) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: Failed on syncfs: %s\n", strerror(errno));
+            exit(1);
+        }
+        close(deferred_fds[i]);
+    }
+    n_deferred = 0;
+#endif
+    for (int i = 0; i < n_pending_removals; i++) {
+        if (remove(pending_removals[i])) {
+            fprintf(stderr, "Error: failed to remove input file `%s': %s\n", pending_removals[i], strerror(errno));
+            exit(1);
+        }
+    }
+    n_pending_removals = 0;
+}
+
+#ifdef NUMA_PLACEMENT
+#define NUMA_MAX_NODES 64
+
+/* CPUs of every NUMA node that has any this process may run on, in node order. */
+static cpu_set_t numa_cpus[NUMA_MAX_NODES];
+static int numa_nodes;
+
+/* Parse a sysfs CPU or node list, such as `0-3,8,10-11'. */
+static int numa_parse_list(const char * list, cpu_set_t * set) {
+    CPU_ZERO(set);
+    while (isdigit((unsigned char)*list)) {
+        char * end;
+        long lo = strtol(list, &end, 10), hi = lo;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (long i = lo; i <= hi && i < CPU_SETSIZE; i++) CPU_SET(i, set);
+        list = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(set);
+}
+
+static int numa_read_list(const char * file, cpu_set_t * set) {
+    char line[4096];
+    int count = 0;
+    FILE * f = fopen(file, "r");
+    if (!f) return 0;
+    if (fgets(line, sizeof(line), f)) count = numa_parse_list(line, set);
+    fclose(f);
+    return count;
+}
+
+/* Discover the NUMA topology. Returns the number of nodes with CPUs, or 0 if it could not be determined. Nodes are
+   limited to the CPU affinity of the process, as under taskset or a cpuset: threads can't be pinned elsewhere. */
+static int numa_init(void) {
+    char file[64];
+    cpu_set_t nodes, allowed;
+    numa_nodes = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+    if (!numa_read_list("/sys/devices/system/node/has_cpu", &nodes)) return 0;
+    for (int node = 0; node < CPU_SETSIZE && numa_nodes < NUMA_MAX_NODES; node++) {
+        if (!CPU_ISSET(node, &nodes)) continue;
+        snprintf(file, sizeof(file), "/sys/devices/system/node/node%d/cpulist", node);
+        if (!numa_read_list(file, &numa_cpus[numa_nodes])) continue;
+        CPU_AND(&numa_cpus[numa_nodes], &numa_cpus[numa_nodes], &allowed);
+        if (CPU_COUNT(&numa_cpus[numa_nodes])) numa_nodes++;
+    }
+    return numa_nodes;
+}
+
+enum { NUMA_SETUP, NUMA_ENCODE, NUMA_DECODE };
+
+struct numa_job {
+    int op;
+    struct bz3_state * state;
+    u8 * buffer;
+    size_t buffer_size;
+    s32 size, orig_size, block_size, flags;
+};
+
+static void * numa_thread(void * arg) {
+    struct numa_job * job = arg;
+    switch (job->op) {
+        case NUMA_SETUP:
+            // The kernel places pages on the node of the CPU that first touches them. The state is only ever
+            // touched by the worker; the buffer is also filled by the reader, so touch it here first.
+            job->state = bz3_new_flags(job->block_size, job->flags);
+            job->buffer = malloc(job->buffer_size);
+            if (job->buffer) memset(job->buffer, 0, job->buffer_size);
+            break;
+        case NUMA_ENCODE: job->size = bz3_encode_block(job->state, job->buffer, job->size); break;
+        case NUMA_DECODE: bz3_decode_block(job->state, job->buffer, job->buffer_size, job->size, job->orig_size); break;
+    }
+    return NULL;
+}
+
+/* Run the jobs in parallel, job i on the CPUs of node i % numa_nodes. A job whose thread can't be started runs on
+   the calling thread instead, wherever that is. */
+static void numa_run(struct numa_job jobs[], s32 n) {
+    pthread_t threads[n];
+    int started[n];
+    for (s32 i = 0; i < n; i++) {
+        pthread_attr_t attr;
+        started[i] = !pthread_attr_init(&attr);
+        if (!started[i]) continue;
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &numa_cpus[i % numa_nodes]);
+        started[i] = !pthread_create(&threads[i], &attr, numa_thread, &jobs[i]);
+        pthread_attr_destroy(&attr);
+    }
+    for (s32 i = 0; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            numa_thread(&jobs[i]);
+    }
+}
+#endif
+
+#ifdef PTHREAD
+/* With -j auto, the amount of blocks coded at a time, between 1 and the amount of states. It grows while coding
+   takes longer than reading and writing the blocks, and shrinks while reading and writing take longer, as the jobs
+   then mostly wait on the disk or the pipe, and the CPUs are better left to others. */
+struct pace {
+    int automatic;
+    s32 active, max;
+    double mark, io, work;
+};
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Count the time since the last mark as spent reading or writing. */
+static void pace_io(struct pace * pace) {
+    double now = seconds();
+    pace->io += now - pace->mark;
+    pace->mark = now;
+}
+
+/* Count the time since the last mark as spent coding. */
+static void pace_work(struct pace * pace) {
+    double now = seconds();
+    pace->work += now - pace->mark;
+    pace->mark = now;
+}
+
+/* Size the next round after the one just written out. */
+static void pace_adapt(struct pace * pace) {
+    pace_io(pace);
+    if (pace->automatic) {
+        if (pace->io > pace->work && pace->active > 1)
+            pace->active--;
+        else if (pace->work > 2 * pace->io && pace->active < pace->max)
+            pace->active++;
+    }
+    pace->io = pace->work = 0;
+}
+
+/* Create the per-worker states and buffers; with `numa', each on the node its worker will run on. */
+static int new_workers(struct bz3_state * states[], u8 * buffers[], size_t buffer_sizes[], s32 n, int block_size,
+                       int flags, int numa) {
+#ifdef NUMA_PLACEMENT
+    if (numa) {
+        struct numa_job jobs[n];
+        for (s32 i = 0; i < n; i++)
+            jobs[i] = (struct numa_job){ .op = NUMA_SETUP, .buffer_size = bz3_bound(block_size),
+                                         .block_size = block_size, .flags = flags };
+        numa_run(jobs, n);
+        for (s32 i = 0; i < n; i++) {
+            states[i] = jobs[i].state;
+            buffers[i] = jobs[i].buffer;
+            buffer_sizes[i] = jobs[i].buffer_size;
+        }
+    } else
+#endif
+        for (s32 i = 0; i < n; i++) {
+            states[i] = bz3_new_flags(block_size, flags);
+            buffer_sizes[i] = bz3_bound(block_size);
+            buffers[i] = malloc(buffer_sizes[i]);
+        }
+
+    for (s32 i = 0; i < n; i++) {
+        if (states[i] == NULL) {
+            fprintf(stderr, "Failed to create a block encoder state.\n");
+            return 0;
+        }
+        if (!buffers[i]) {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void encode_blocks(struct bz3_state * states[], u8 * buffers[], s32 sizes[], s32 n, int numa) {
+#ifdef NUMA_PLACEMENT
+    if (numa) {
+        struct numa_job jobs[n];
+        for (s32 i = 0; i < n; i++)
+            jobs[i] =
+                (struct numa_job){ .op = NUMA_ENCODE, .state = states[i], .buffer = buffers[i], .size = sizes[i] };
+        numa_run(jobs, n);
+        for (s32 i = 0; i < n; i++) sizes[i] = jobs[i].size;
+        return;
+    }
+#endif
+    bz3_encode_blocks(states, buffers, sizes, n);
+}
+
+static void decode_blocks(struct bz3_state * states[], u8 * buffers[], size_t buffer_sizes[], s32 sizes[],
+                          s32 orig_sizes[], s32 n, int numa) {
+#ifdef NUMA_PLACEMENT
+    if (numa) {
+        struct numa_job jobs[n];
+        for (s32 i = 0; i < n; i++)
+            jobs[i] = (struct numa_job){ .op = NUMA_DECODE, .state = states[i], .buffer = buffers[i],
+                                         .buffer_size = buffer_sizes[i], .size = sizes[i],
+                                         .orig_size = orig_sizes[i] };
+        numa_run(jobs, n);
+        return;
+    }
+#endif
+    bz3_decode_blocks(states, buffers, buffer_sizes, sizes, orig_sizes, n);
+}
+#endif
+
+#ifdef __linux__
+/* Read `size' bytes at `offset' through the two aligned pages at `page', as O_DIRECT descriptors need. */
+static int read_header(int fd, u8 * page, off_t offset, u8 * header, size_t size) {
+    off_t base = offset / 4096 * 4096;
+    ssize_t n = pread(fd, page, 8192, base);
+    if (n < offset - base + (off_t)size) return 0;
+    memcpy(header, page + (offset - base), size);
+    return 1;
+}
+
+/* The size that decoding the seekable input `fd' gives, summed up from the block headers; 0 if it is not known, or if
+   any block is larger than the block size in the file header allows, as decoding would reject it anyway. The largest
+   block goes to `largest' if it isn't NULL. */
+static uint64_t decoded_size(int fd, s32 * largest) {
+    struct stat st;
+    void * page;
+    u8 header[9];
+    uint64_t total = 0;
+    off_t offset = 9;
+    s32 block_size = 0;
+    if (fstat(fd, &st) || posix_memalign(&page, 4096, 8192)) return 0;
+    if (!read_header(fd, page, 0, header, 9) || memcmp(header, "BZ3v1", 5)) offset = -1;
+    if (offset >= 0) block_size = read_neutral_s32(header + 5);
+    if (block_size < KiB(65) || block_size > MiB(511)) offset = -1;
+    while (offset >= 0 && offset < st.st_size) {
+        if (!read_header(fd, page, offset, header, 8)) break;
+        s32 new_size = read_neutral_s32(header), old_size = read_neutral_s32(header + 4);
+        if (new_size < 0 || old_size < 0 || old_size > block_size || new_size > bz3_bound(block_size)) break;
+        if (largest != NULL && old_size > *largest) *largest = old_size;
+        total += old_size;
+        offset += 8 + (off_t)new_size;
+    }
+    free(page);
+    return offset == st.st_size ? total : 0;
+}
+#endif
+
+/* The amount of data to be split into blocks: the size of the input when encoding, and the sum of the block sizes
+   in the headers otherwise. 0 if it can't be known, as with pipes. */
+static uint64_t data_size(FILE * input_des, int mode) {
+    struct file_stream * in = find_stream(input_des);
+    struct stat st;
+    if (in == NULL) return 0;
+    if (mode == MODE_ENCODE) return fstat(in->fd, &st) ? 0 : (uint64_t)st.st_size;
+#ifdef __linux__
+    return decoded_size(in->fd, NULL);
+#else
+    return 0;
+#endif
+}
+
+/* The largest block that coding the input takes: `block_size', or less if the input is known to be smaller. */
+static s32 largest_block(FILE * input_des, int mode, s32 block_size) {
+    if (mode == MODE_ENCODE) {
+        uint64_t size = data_size(input_des, mode);
+        return size && size < (uint64_t)block_size ? (s32)size : block_size;
+    }
+#ifdef __linux__
+    struct file_stream * in = find_stream(input_des);
+    s32 largest = 0;
+    if (in != NULL && decoded_size(in->fd, &largest) && largest < block_size) return largest;
+#endif
+    return block_size;
+}
+
+#ifdef __linux__
+/* Preallocate the output from an estimate of its size, so that it is laid out in one piece: the input size when
+   encoding, and the exact size when decoding. The file size is left alone, so that the output never looks bigger
+   than what was written, even if the run is cut short; close_out_file frees what was reserved past the end. */
+static void reserve_output(FILE * input_des, FILE * output_des, int mode) {
+    struct file_stream * out = find_stream(output_des);
+    uint64_t size = mode != MODE_TEST ? data_size(input_des, mode) : 0;
+    /* Without support in the file system, the output grows as it is written instead. */
+    if (out != NULL && size > 0 && !fallocate(out->fd, FALLOC_FL_KEEP_SIZE, 0, size)) out->reserved = 1;
+}
+#endif
+
+/* Fit `workers' jobs on blocks of `block_size' into the memory limit, if there is one, adjusting the amount of jobs
+   and the state flags. Returns 0 if not even one job fits within a limit given by --memlimit; one job goes ahead
+   anyway under the limit of the control group, as the pages it never touches aren't charged to it. */
+static int plan_memory(uint64_t memlimit, int mode, int block_size, int * workers, int * flags, int verbose) {
+    if (!memlimit) return 1;
+    s32 wanted = *workers > 1 ? *workers : 1;
+    s32 min_flags = *flags | BZ3_FLAG_IN_PLACE | (mode != MODE_ENCODE ? BZ3_FLAG_LOW_MEMORY : 0);
+    s32 plan_flags = min_flags;
+    size_t budget = memlimit > SIZE_MAX ? SIZE_MAX : (size_t)memlimit;
+    s32 fit = bz3_plan_workers(budget, block_size, wanted, &plan_flags);
+    if (fit == 0) {
+        size_t needed = bz3_min_memory_needed_flags(block_size, min_flags) + bz3_bound(block_size);
+        if (memlimit_given) {
+            fprintf(stderr, "Not enough memory: block size %d MiB needs %zu MiB, but the limit is %" PRIu64 " MiB.\n",
+                    block_size / MiB(1), needed / MiB(1) + 1, memlimit / MiB(1));
+            return 0;
+        }
+        if (verbose)
+            fprintf(stderr, "Memory limit: block size %d MiB needs %zu MiB, over the cgroup limit of %" PRIu64
+                            " MiB; running one job.\n",
+                    block_size / MiB(1), needed / MiB(1) + 1, memlimit / MiB(1));
+        fit = 1;
+        plan_flags = min_flags;
+    }
+    if (verbose && fit < wanted) fprintf(stderr, "Memory limit: reducing the amount of jobs to %d.\n", fit);
+    if (verbose && (plan_flags & ~*flags & BZ3_FLAG_LOW_MEMORY))
+        fprintf(stderr, "Memory limit: using the low memory decoder.\n");
+    else if (verbose && (plan_flags & ~*flags & BZ3_FLAG_IN_PLACE))
+        fprintf(stderr, "Memory limit: working without a swap buffer.\n");
+    if (*workers > 1) *workers = fit;
+    *flags = plan_flags;
+    return 1;
+}
+
+static void report(const char * file_name, int mode, uint64_t bytes_read, uint64_t bytes_written) {
+    if (file_name) fprintf(stderr, " %s:", file_name);
+    if (mode == MODE_ENCODE)
+        fprintf(stderr, "\t%" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", bytes_read, bytes_written,
+                (double)bytes_written * 100.0 / bytes_read, (double)bytes_written * 8.0 / bytes_read);
+    else if (mode == MODE_DECODE)
+        fprintf(stderr, "\t%" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", bytes_read, bytes_written,
+                (double)bytes_read * 100.0 / bytes_written, (double)bytes_read * 8.0 / bytes_written);
+    else
+        fprintf(stderr, "\tOK, %" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", bytes_read, bytes_written,
+                (double)bytes_read * 100.0 / bytes_written, (double)bytes_read * 8.0 / bytes_written);
+}
+
+static int process(FILE * input_des, FILE * output_des, int mode, int block_size, int level, int workers, int flags,
+                   uint64_t memlimit, int numa, int verbose, char * file_name) {
     uint64_t bytes_read = 0, bytes_written = 0;
 
     if ((mode == MODE_ENCODE && isatty(fileno(output_des))) ||
@@ -169,15 +1152,19 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
 
     u8 byteswap_buf[4];
 
+#ifdef PTHREAD
+    // With --split, smaller blocks for files that would otherwise leave some of the jobs idle. The header records the
+    // size chosen, so decoding needs nothing special.
+    if (split && mode == MODE_ENCODE && (workers == JOBS_AUTO || workers > 1)) {
+        s32 blocks = workers == JOBS_AUTO ? bz3_auto_threads(0, block_size) : workers;
+        s32 split_size = bz3_split_block_size(data_size(input_des, mode), block_size, blocks);
+        if (verbose && split_size != block_size) fprintf(stderr, "Block size: %d KiB.\n", split_size / KiB(1));
+        block_size = split_size;
+    }
+#endif
+
     switch (mode) {
-        case MODE_ENCODE:
-            xwrite("BZ3v1", 5, 1, output_des);
-
-            write_neutral_s32(byteswap_buf, block_size);
-            xwrite(byteswap_buf, 4, 1, output_des);
-
-            bytes_written += 9;
-            break;
+        case MODE_ENCODE: break; // The header is written once the memory is planned.
         case MODE_RECOVER:
         case MODE_DECODE:
         case MODE_TEST: {
@@ -209,21 +1196,58 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
         }
     }
 
+    // The low memory mode only concerns decoding.
+    if (mode == MODE_ENCODE) flags &= ~BZ3_FLAG_LOW_MEMORY;
+
+#ifdef PTHREAD
+    // With -j auto, as many jobs as there are CPUs to run them on. Either way, no more than there are blocks.
+    struct pace pace = { .automatic = workers == JOBS_AUTO };
+    if (workers == JOBS_AUTO || workers > 1) {
+        uint64_t size = data_size(input_des, mode);
+        if (workers == JOBS_AUTO) {
+            workers = bz3_auto_threads(size, block_size);
+            if (workers > 64) workers = 64;
+            if (verbose) fprintf(stderr, "Jobs: up to %d.\n", workers);
+        } else if (size && (size - 1) / block_size + 1 < (uint64_t)workers)
+            workers = (size - 1) / block_size + 1;
+    }
+#endif
+
+    // Nothing is written before the plan, so that a refusal leaves no partial output behind. Inputs smaller than a
+    // block only need the memory of what they hold.
+    if (!plan_memory(memlimit, mode, largest_block(input_des, mode, block_size), &workers, &flags, verbose)) return 1;
+
+#ifdef __linux__
+    reserve_output(input_des, output_des, mode);
+#endif
+
+    if (mode == MODE_ENCODE) {
+        xwrite("BZ3v1", 5, 1, output_des);
+
+        write_neutral_s32(byteswap_buf, block_size);
+        xwrite(byteswap_buf, 4, 1, output_des);
+
+        bytes_written += 9;
+    }
+
 #ifdef PTHREAD
     if (workers > 64 || workers < 0) {
         fprintf(stderr, "Number of workers must be between 0 and 64.\n");
         return 1;
     }
+    pace.active = pace.max = workers;
 
     if (workers <= 1) {
 #endif
-        struct bz3_state * state = bz3_new(block_size);
+        struct bz3_state * state = bz3_new_flags(block_size, flags);
 
         if (state == NULL) {
             fprintf(stderr, "Failed to create a block encoder state.\n");
             return 1;
         }
 
+        bz3_set_level(state, level);
+
         size_t buffer_size = bz3_bound(block_size);
         u8 * buffer = malloc(buffer_size);
 
@@ -234,8 +1258,9 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
 
         if (mode == MODE_ENCODE) {
             s32 read_count;
+            uint64_t blocks = 0;
             while (!feof(input_des)) {
-                read_count = xread(buffer, 1, block_size, input_des);
+                read_count = xread(buffer, 1, ramp_block_size(block_size, blocks++), input_des);
                 bytes_read += read_count;
 
                 if (read_count == 0) break;
@@ -333,34 +1358,27 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
         s32 sizes[workers];
         size_t buffer_sizes[workers];
         s32 old_sizes[workers];
-        for (s32 i = 0; i < workers; i++) {
-            states[i] = bz3_new(block_size);
-            if (states[i] == NULL) {
-                fprintf(stderr, "Failed to create a block encoder state.\n");
-                return 1;
-            }
-            size_t buffer_size = bz3_bound(block_size);
-            buffer_sizes[i] = buffer_size;
-            buffers[i] = malloc(buffer_size);
-            if (!buffers[i]) {
-                fprintf(stderr, "Failed to allocate memory.\n");
-                return 1;
-            }
-        }
+        if (!new_workers(states, buffers, buffer_sizes, workers, block_size, flags, numa)) return 1;
+        for (s32 i = 0; i < workers; i++) bz3_set_level(states[i], level);
 
         if (mode == MODE_ENCODE) {
+            uint64_t blocks = 0;
+            pace.mark = seconds();
             while (!feof(input_des)) {
                 s32 i = 0;
-                for (; i < workers; i++) {
-                    size_t read_count = xread(buffers[i], 1, block_size, input_des);
+                for (; i < pace.active; i++) {
+                    size_t wanted = ramp_block_size(block_size, blocks++);
+                    size_t read_count = xread(buffers[i], 1, wanted, input_des);
                     bytes_read += read_count;
                     sizes[i] = old_sizes[i] = read_count;
-                    if (read_count < block_size) {
+                    if (read_count < wanted) {
                         i++;
                         break;
                     }
                 }
-                bz3_encode_blocks(states, buffers, sizes, i);
+                pace_io(&pace);
+                encode_blocks(states, buffers, sizes, i, numa);
+                pace_work(&pace);
                 for (s32 j = 0; j < i; j++) {
                     if (bz3_last_error(states[j]) != BZ3_OK) {
                         fprintf(stderr, "Failed to encode data: %s\n", bz3_strerror(states[j]));
@@ -375,12 +1393,14 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
                     xwrite(buffers[j], sizes[j], 1, output_des);
                     bytes_written += 8 + sizes[j];
                 }
+                pace_adapt(&pace);
             }
             fflush(output_des);
         } else if (mode == MODE_DECODE) {
+            pace.mark = seconds();
             while (!feof(input_des)) {
                 s32 i = 0;
-                for (; i < workers; i++) {
+                for (; i < pace.active; i++) {
                     if (!xread_eofcheck(&byteswap_buf, 1, 4, input_des)) break;
                     sizes[i] = read_neutral_s32(byteswap_buf);
                     xread_noeof(&byteswap_buf, 1, 4, input_des);
@@ -392,7 +1412,9 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
                     xread_noeof(buffers[i], 1, sizes[i], input_des);
                     bytes_read += 8 + sizes[i];
                 }
-                bz3_decode_blocks(states, buffers, buffer_sizes, sizes, old_sizes, i);
+                pace_io(&pace);
+                decode_blocks(states, buffers, buffer_sizes, sizes, old_sizes, i, numa);
+                pace_work(&pace);
                 for (s32 j = 0; j < i; j++) {
                     if (bz3_last_error(states[j]) != BZ3_OK) {
                         fprintf(stderr, "Failed to decode data: %s\n", bz3_strerror(states[j]));
@@ -403,12 +1425,14 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
                     xwrite(buffers[j], old_sizes[j], 1, output_des);
                     bytes_written += old_sizes[j];
                 }
+                pace_adapt(&pace);
             }
             fflush(output_des);
         } else if (mode == MODE_RECOVER) {
+            pace.mark = seconds();
             while (!feof(input_des)) {
                 s32 i = 0;
-                for (; i < workers; i++) {
+                for (; i < pace.active; i++) {
                     if (!xread_eofcheck(&byteswap_buf, 1, 4, input_des)) break;
                     sizes[i] = read_neutral_s32(byteswap_buf);
                     xread_noeof(&byteswap_buf, 1, 4, input_des);
@@ -420,7 +1444,9 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
                     xread_noeof(buffers[i], 1, sizes[i], input_des);
                     bytes_read += 8 + sizes[i];
                 }
-                bz3_decode_blocks(states, buffers, buffer_sizes, sizes, old_sizes, i);
+                pace_io(&pace);
+                decode_blocks(states, buffers, buffer_sizes, sizes, old_sizes, i, numa);
+                pace_work(&pace);
                 for (s32 j = 0; j < i; j++) {
                     if (bz3_last_error(states[j]) != BZ3_OK) {
                         fprintf(stderr, "Writing invalid block: %s\n", bz3_strerror(states[j]));
@@ -430,12 +1456,14 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
                     xwrite(buffers[j], old_sizes[j], 1, output_des);
                     bytes_written += old_sizes[j];
                 }
+                pace_adapt(&pace);
             }
             fflush(output_des);
         } else if (mode == MODE_TEST) {
+            pace.mark = seconds();
             while (!feof(input_des)) {
                 s32 i = 0;
-                for (; i < workers; i++) {
+                for (; i < pace.active; i++) {
                     if (!xread_eofcheck(&byteswap_buf, 1, 4, input_des)) break;
                     sizes[i] = read_neutral_s32(byteswap_buf);
                     xread_noeof(&byteswap_buf, 1, 4, input_des);
@@ -448,13 +1476,16 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
                     bytes_read += 8 + sizes[i];
                     bytes_written += old_sizes[i];
                 }
-                bz3_decode_blocks(states, buffers, buffer_sizes, sizes, old_sizes, i);
+                pace_io(&pace);
+                decode_blocks(states, buffers, buffer_sizes, sizes, old_sizes, i, numa);
+                pace_work(&pace);
                 for (s32 j = 0; j < i; j++) {
                     if (bz3_last_error(states[j]) != BZ3_OK) {
                         fprintf(stderr, "Failed to decode data: %s\n", bz3_strerror(states[j]));
                         return 1;
                     }
                 }
+                pace_adapt(&pace);
             }
         }
 
@@ -465,18 +1496,7 @@ static int process(FILE * input_des, FILE * output_des, int mode, int block_size
     }
 #endif
 
-    if (verbose) {
-        if (file_name) fprintf(stderr, " %s:", file_name);
-        if (mode == MODE_ENCODE)
-            fprintf(stderr, "\t%" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", bytes_read, bytes_written,
-                    (double)bytes_written * 100.0 / bytes_read, (double)bytes_written * 8.0 / bytes_read);
-        else if (mode == MODE_DECODE)
-            fprintf(stderr, "\t%" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", bytes_read, bytes_written,
-                    (double)bytes_read * 100.0 / bytes_written, (double)bytes_read * 8.0 / bytes_written);
-        else
-            fprintf(stderr, "\tOK, %" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", bytes_read, bytes_written,
-                    (double)bytes_read * 100.0 / bytes_written, (double)bytes_read * 8.0 / bytes_written);
-    }
+    if (verbose) report(file_name, mode, bytes_read, bytes_written);
 
     return 0;
 }
@@ -493,7 +1513,25 @@ static int is_numeric(const char * str) {
     return 1;
 }
 
-static FILE * open_output(char * output, int force) {
+/* Keep track of `des' in `streams' if it is a regular file. Streams of the io_uring engine are in there already. */
+static struct file_stream * track_stream(FILE * des, int writing) {
+    struct file_stream * s = find_stream(des);
+    struct stat st;
+    if (s == NULL && !fstat(fileno(des), &st) && S_ISREG(st.st_mode)) s = add_stream(des, fileno(des), writing);
+    return s;
+}
+
+static FILE * open_named_output(const char * name, int io) {
+    FILE * des = NULL;
+#ifdef IO_URING
+    if (io != IO_STDIO) des = uring_open(name, 1, io == IO_DIRECT);
+#endif
+    if (des == NULL) des = fopen(name, "wb");
+    if (des != NULL) track_stream(des, 1);
+    return des;
+}
+
+static FILE * open_output(char * output, int force, int io) {
     FILE * output_des = NULL;
 
     if (output != NULL) {
@@ -509,7 +1547,7 @@ static FILE * open_output(char * output, int force) {
             }
         }
 
-        output_des = fopen(output, "wb");
+        output_des = open_named_output(output, io);
         if (output_des == NULL) {
             fprintf(stderr, "Error: failed to open output file `%s': %s\n", output, strerror(errno));
             exit(1);
@@ -521,7 +1559,7 @@ static FILE * open_output(char * output, int force) {
     return output_des;
 }
 
-static FILE * open_input(char * input) {
+static FILE * open_input(char * input, int io) {
     FILE * input_des = NULL;
 
     if (input != NULL) {
@@ -530,11 +1568,20 @@ static FILE * open_input(char * input) {
             exit(1);
         }
 
-        input_des = fopen(input, "rb");
+#ifdef IO_URING
+        if (io != IO_STDIO) input_des = uring_open(input, 0, io == IO_DIRECT);
+#endif
+        if (input_des == NULL) input_des = fopen(input, "rb");
         if (input_des == NULL) {
             fprintf(stderr, "Error: failed to open input file `%s': %s\n", input, strerror(errno));
             exit(1);
         }
+        struct file_stream * s = track_stream(input_des, 0);
+#ifdef __linux__
+        if (s != NULL) posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+        (void)s;
+#endif
     } else {
         input_des = stdin;
     }
@@ -542,6 +1589,593 @@ static FILE * open_input(char * input) {
     return input_des;
 }
 
+/* The history size of the dictionaries made by --train. */
+#define TRAIN_HISTORY KiB(64)
+
+static int train(char * dict_name, char ** files, int n_files, int force, int verbose) {
+    size_t total = 0, capacity = 0;
+    size_t * sizes = malloc(n_files * sizeof(size_t));
+    u8 * samples = NULL;
+    if (!sizes) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < n_files; i++) {
+        FILE * input_des = open_input(files[i], IO_STDIO);
+        sizes[i] = 0;
+        for (;;) {
+            if (capacity - total < KiB(64)) {
+                capacity = capacity ? capacity * 2 : MiB(1);
+                samples = realloc(samples, capacity);
+                if (!samples) {
+                    fprintf(stderr, "Failed to allocate memory.\n");
+                    return 1;
+                }
+            }
+            size_t read = xread(samples + total, 1, capacity - total, input_des);
+            if (!read) break;
+            sizes[i] += read;
+            total += read;
+        }
+        close_in_file(input_des);
+    }
+
+    size_t dict_size = bz3_dict_bound(TRAIN_HISTORY);
+    u8 * dict = malloc(dict_size);
+    if (!dict) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return 1;
+    }
+
+    int error = bz3_train_dict(samples, sizes, n_files, 0, dict, &dict_size);
+    if (error != BZ3_OK) {
+        fprintf(stderr, "Failed to train the dictionary: error %d.\n", error);
+        return 1;
+    }
+
+    FILE * output_des = open_output(dict_name, force, IO_STDIO);
+    xwrite(dict, 1, dict_size, output_des);
+    close_out_file(output_des);
+
+    if (verbose) {
+        struct bz3_dict * loaded = bz3_dict_new(dict, dict_size);
+        fprintf(stderr, "Dictionary %08" PRIx32 ": %d samples, %zu bytes -> %zu bytes\n",
+                loaded ? bz3_dict_id(loaded) : 0, n_files, total, dict_size);
+        if (loaded) bz3_dict_free(loaded);
+    }
+
+    free(samples);
+    free(sizes);
+    free(dict);
+    return 0;
+}
+
+/* Batch mode (-B) runs all the files through one pool of workers, each of which keeps its state and block buffer from
+   one file to the next. A worker takes the next block of the oldest file that has any left, opening another file when
+   all of them are read, codes it, and writes it out once the blocks before it in the same file are written. Files
+   are only read and written under `lock', so that the coding is what runs in parallel. Outputs go to a temporary file
+   next to the final one, which is renamed into place once complete: a failed run, or one stopped by SIGINT, SIGTERM or
+   SIGHUP where threads are available, leaves no partial outputs behind. */
+struct batch_file {
+    struct batch_file * next;
+    char * input;
+    char *output, *temp; /* NULL when testing */
+    FILE *input_des, *output_des;
+    s32 block_size;
+    s32 reads, writes; /* blocks read and written so far */
+    int eof, failed;
+    uint64_t bytes_read, bytes_written;
+};
+
+struct batch {
+#ifdef PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t written;
+#endif
+    char ** files;
+    int n_files, next_file;
+    struct batch_file * active; /* the files being processed, oldest first */
+    int mode, block_size, level, flags, force, remove_input_file, io, verbose;
+    mode_t umask;
+    int status;
+};
+
+struct batch_worker {
+    struct batch * batch;
+    struct bz3_state * state;
+    u8 * buffer;
+    size_t buffer_size;
+    s32 block_size;
+    s32 seq, size, orig_size; /* the block in `buffer' */
+#ifdef PTHREAD
+    pthread_t thread;
+#endif
+};
+
+static struct batch * running_batch;
+
+/* Remove the temporary outputs when bzip3 exits on an error halfway through a batch. */
+static void batch_cleanup(void) {
+    if (running_batch == NULL) return;
+    for (struct batch_file * f = running_batch->active; f != NULL; f = f->next)
+        if (f->temp != NULL) remove(f->temp);
+}
+
+static void batch_lock(struct batch * b) {
+#ifdef PTHREAD
+    pthread_mutex_lock(&b->lock);
+#else
+    (void)b;
+#endif
+}
+
+static void batch_unlock(struct batch * b) {
+#ifdef PTHREAD
+    pthread_mutex_unlock(&b->lock);
+#else
+    (void)b;
+#endif
+}
+
+#ifdef BATCH_SIGNALS
+/* The signals that stop a batch. They are blocked in every thread while it runs and taken by batch_signals instead,
+   which removes the temporary outputs under the lock, so that no file is opened or renamed meanwhile, and then dies
+   of the signal as bzip3 would have. */
+static sigset_t batch_sigset;
+
+static void * batch_signals(void * arg) {
+    struct batch * b = arg;
+    int sig;
+    if (sigwait(&batch_sigset, &sig)) return NULL;
+    batch_lock(b);
+    batch_cleanup();
+    signal(sig, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, &batch_sigset, NULL);
+    raise(sig);
+    _exit(128 + sig);
+}
+#endif
+
+static int has_bz3_extension(const char * name) {
+    size_t length = strlen(name);
+    return length > 4 && !strcmp(name + length - 4, ".bz3");
+}
+
+/* Close `f' and take it off the active list. A complete output is renamed into place and the input removed with
+   --rm; a failed one is deleted. */
+static void batch_finish(struct batch * b, struct batch_file * f) {
+    if (f->input_des != NULL) close_in_file(f->input_des);
+    if (f->output_des != NULL) {
+        if (f->failed) {
+            remove_stream(f->output_des);
+            fclose(f->output_des);
+        } else {
+            close_out_file(f->output_des);
+            if (rename(f->temp, f->output)) {
+                fprintf(stderr, "Error: failed to rename `%s' to `%s': %s\n", f->temp, f->output, strerror(errno));
+                f->failed = 1;
+            } else {
+#ifdef __linux__
+                if (sync_mode == SYNC_ALWAYS) sync_parent(f->output);
+#endif
+                free(f->temp);
+                f->temp = NULL;
+            }
+        }
+    }
+    if (f->temp != NULL) remove(f->temp);
+
+    /* Only now: close_out_file exits on errors, and batch_cleanup has to find the temporary output then. */
+    struct batch_file ** p = &b->active;
+    while (*p != f) p = &(*p)->next;
+    *p = f->next;
+
+    if (f->failed)
+        b->status = 1;
+    else {
+        if (b->verbose) report(f->input, b->mode, f->bytes_read, f->bytes_written);
+        if (b->remove_input_file && f->output != NULL) remove_in_file(f->input, NULL);
+    }
+    free(f->output);
+    free(f->temp);
+    free(f);
+}
+
+/* Open the next file of the batch and add it to the active list. */
+static void batch_open(struct batch * b) {
+    struct batch_file * f = calloc(1, sizeof(struct batch_file));
+    if (f == NULL) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(1);
+    }
+    f->input = b->files[b->next_file++];
+    f->block_size = b->block_size;
+
+    struct batch_file ** p = &b->active;
+    while (*p != NULL) p = &(*p)->next;
+    *p = f;
+
+    if (is_dir(f->input)) {
+        fprintf(stderr, "Error: input `%s' is a directory.\n", f->input);
+        goto fail;
+    }
+
+    if (b->mode != MODE_TEST) {
+        size_t length = strlen(f->input);
+        if (b->mode == MODE_DECODE && !has_bz3_extension(f->input)) {
+            fprintf(stderr, "Warning: file %s has an unknown extension, skipping.\n", f->input);
+            goto fail;
+        }
+        f->output = malloc(length + 5);
+        if (!f->output) {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            exit(1);
+        }
+        strcpy(f->output, f->input);
+        if (b->mode == MODE_ENCODE)
+            strcat(f->output, ".bz3");
+        else
+            f->output[length - 4] = 0;
+
+        if (is_dir(f->output)) {
+            fprintf(stderr, "Error: output file `%s' is a directory.\n", f->output);
+            goto fail;
+        }
+        if (!b->force && access(f->output, F_OK) == 0) {
+            fprintf(stderr, "Error: output file `%s' already exists. Use -f to force overwrite.\n", f->output);
+            goto fail;
+        }
+    }
+
+    f->input_des = open_input(f->input, b->io);
+
+    if (b->mode != MODE_ENCODE) {
+        char signature[5];
+        u8 byteswap_buf[4];
+
+        if (xread(signature, 5, 1, f->input_des) != 1 || strncmp(signature, "BZ3v1", 5) != 0) {
+            fprintf(stderr, "%s: Invalid signature.\n", f->input);
+            goto fail;
+        }
+
+        xread_noeof(byteswap_buf, 4, 1, f->input_des);
+        f->block_size = read_neutral_s32(byteswap_buf);
+
+        if (f->block_size < KiB(65) || f->block_size > MiB(511)) {
+            fprintf(stderr, "%s: The input file is corrupted. Reason: Invalid block size in the header.\n", f->input);
+            goto fail;
+        }
+        f->bytes_read = 9;
+    }
+
+    if (f->output != NULL) {
+        f->temp = malloc(strlen(f->output) + 8);
+        if (!f->temp) {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            exit(1);
+        }
+        sprintf(f->temp, "%s.XXXXXX", f->output);
+        int fd = mkstemp(f->temp);
+        if (fd < 0) {
+            fprintf(stderr, "Error: failed to open output file `%s': %s\n", f->temp, strerror(errno));
+            free(f->temp);
+            f->temp = NULL;
+            goto fail;
+        }
+        fchmod(fd, 0666 & ~b->umask);
+        close(fd);
+
+        f->output_des = open_named_output(f->temp, b->io);
+        if (f->output_des == NULL) {
+            fprintf(stderr, "Error: failed to open output file `%s': %s\n", f->temp, strerror(errno));
+            goto fail;
+        }
+#ifdef __linux__
+        reserve_output(f->input_des, f->output_des, b->mode);
+#endif
+
+        if (b->mode == MODE_ENCODE) {
+            u8 byteswap_buf[4];
+            xwrite("BZ3v1", 5, 1, f->output_des);
+            write_neutral_s32(byteswap_buf, f->block_size);
+            xwrite(byteswap_buf, 4, 1, f->output_des);
+            f->bytes_written = 9;
+        }
+    }
+    return;
+
+fail:
+    f->failed = f->eof = 1;
+    batch_finish(b, f);
+}
+
+/* Make sure the state and the buffer of `w' can take blocks of `block_size' bytes. */
+static void batch_state(struct batch * b, struct batch_worker * w, s32 block_size) {
+    if (w->state != NULL && w->block_size >= block_size) return;
+
+    if (w->state != NULL) bz3_free(w->state);
+    free(w->buffer);
+    w->state = bz3_new_flags(block_size, b->flags);
+    w->buffer_size = bz3_bound(block_size);
+    w->buffer = malloc(w->buffer_size);
+    w->block_size = block_size;
+
+    if (w->state == NULL || w->buffer == NULL) {
+        fprintf(stderr, "Failed to create a block encoder state.\n");
+        exit(1);
+    }
+
+    bz3_set_level(w->state, b->level);
+}
+
+/* Read the next block of `f' into the buffer of `w'. Returns 0 when there is none left. */
+static int batch_read(struct batch * b, struct batch_worker * w, struct batch_file * f) {
+    batch_state(b, w, f->block_size);
+
+    if (b->mode == MODE_ENCODE) {
+        s32 read_count = xread(w->buffer, 1, f->block_size, f->input_des);
+        f->bytes_read += read_count;
+        if (feof(f->input_des)) f->eof = 1;
+        if (read_count == 0) {
+            f->eof = 1;
+            return 0;
+        }
+        w->size = w->orig_size = read_count;
+    } else {
+        u8 byteswap_buf[4];
+
+        if (!xread_eofcheck(byteswap_buf, 1, 4, f->input_des)) {
+            f->eof = 1;
+            return 0;
+        }
+        w->size = read_neutral_s32(byteswap_buf);
+        xread_noeof(byteswap_buf, 1, 4, f->input_des);
+        w->orig_size = read_neutral_s32(byteswap_buf);
+        if (w->orig_size > bz3_bound(f->block_size) || w->size > bz3_bound(f->block_size)) {
+            fprintf(stderr, "%s: Failed to decode a block: Inconsistent headers.\n", f->input);
+            f->failed = f->eof = 1;
+            return 0;
+        }
+        xread_noeof(w->buffer, 1, w->size, f->input_des);
+        f->bytes_read += 8 + w->size;
+    }
+    w->seq = f->reads++;
+    return 1;
+}
+
+/* Find the next block to code and read it into the buffer of `w'. Returns its file, or NULL once all are read. */
+static struct batch_file * batch_next(struct batch * b, struct batch_worker * w) {
+    while (1) {
+        struct batch_file * f = b->active;
+        while (f != NULL && f->eof) f = f->next;
+
+        if (f != NULL) {
+            if (batch_read(b, w, f)) return f;
+            if (f->writes == f->reads) batch_finish(b, f);
+        } else if (b->next_file < b->n_files) {
+            batch_open(b);
+        } else {
+            return NULL;
+        }
+    }
+}
+
+static void * batch_work(void * arg) {
+    struct batch_worker * w = arg;
+    struct batch * b = w->batch;
+    struct batch_file * f;
+
+    batch_lock(b);
+    while ((f = batch_next(b, w)) != NULL) {
+        s32 seq = w->seq, new_size = w->size;
+        int ok;
+
+        batch_unlock(b);
+        if (b->mode == MODE_ENCODE)
+            ok = (new_size = bz3_encode_block(w->state, w->buffer, w->size)) != -1;
+        else
+            ok = bz3_decode_block(w->state, w->buffer, w->buffer_size, w->size, w->orig_size) != -1;
+        if (!ok)
+            fprintf(stderr, "%s: Failed to %s a block: %s\n", f->input, b->mode == MODE_ENCODE ? "encode" : "decode",
+                    bz3_strerror(w->state));
+        batch_lock(b);
+
+#ifdef PTHREAD
+        while (f->writes != seq) pthread_cond_wait(&b->written, &b->lock);
+#else
+        (void)seq;
+#endif
+        if (!ok) f->failed = f->eof = 1;
+        if (!f->failed) {
+            if (b->mode == MODE_ENCODE) {
+                u8 byteswap_buf[4];
+                write_neutral_s32(byteswap_buf, new_size);
+                xwrite(byteswap_buf, 4, 1, f->output_des);
+                write_neutral_s32(byteswap_buf, w->size);
+                xwrite(byteswap_buf, 4, 1, f->output_des);
+                xwrite(w->buffer, new_size, 1, f->output_des);
+                f->bytes_written += 8 + new_size;
+            } else {
+                if (f->output_des != NULL) xwrite(w->buffer, w->orig_size, 1, f->output_des);
+                f->bytes_written += w->orig_size;
+            }
+        }
+        f->writes++;
+        if (f->eof && f->writes == f->reads) batch_finish(b, f);
+#ifdef PTHREAD
+        pthread_cond_broadcast(&b->written);
+#endif
+    }
+    batch_unlock(b);
+    return NULL;
+}
+
+/* Compress, decompress or test `files' in batch mode. Returns 1 if any of them failed. */
+static int batch_process(char ** files, int n_files, int mode, int block_size, int level, int workers, int flags,
+                         uint64_t memlimit, int force, int remove_input_file, int io, int verbose) {
+    /* The workers only set up a state once they get a block, so with -j auto there is no point in counting the
+       blocks of all the files beforehand. */
+    if (workers == JOBS_AUTO) {
+        workers = bz3_auto_threads(0, block_size);
+        if (workers > 64) workers = 64;
+        if (verbose) fprintf(stderr, "Jobs: up to %d.\n", workers);
+    }
+
+    if (workers > 64 || workers < 0) {
+        fprintf(stderr, "Number of workers must be between 0 and 64.\n");
+        return 1;
+    }
+
+    // The low memory mode only concerns decoding.
+    if (mode == MODE_ENCODE) flags &= ~BZ3_FLAG_LOW_MEMORY;
+
+    // Decoding plans for blocks of the size set by the level, as those of the files are not known yet.
+    if (!plan_memory(memlimit, mode, block_size, &workers, &flags, verbose)) return 1;
+    if (workers < 1) workers = 1;
+
+    struct batch b = { .files = files,
+                       .n_files = n_files,
+                       .mode = mode,
+                       .block_size = block_size,
+                       .level = level,
+                       .flags = flags,
+                       .force = force,
+                       .remove_input_file = remove_input_file,
+                       .io = io,
+                       .verbose = verbose };
+    struct batch_worker * pool = calloc(workers, sizeof(struct batch_worker));
+    if (!pool) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return 1;
+    }
+    b.umask = umask(0);
+    umask(b.umask);
+
+    running_batch = &b;
+    atexit(batch_cleanup);
+
+    for (int i = 0; i < workers; i++) pool[i].batch = &b;
+#ifdef PTHREAD
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.written, NULL);
+#ifdef BATCH_SIGNALS
+    sigset_t old_sigset;
+    pthread_t signal_thread;
+    sigemptyset(&batch_sigset);
+    sigaddset(&batch_sigset, SIGINT);
+    sigaddset(&batch_sigset, SIGTERM);
+    sigaddset(&batch_sigset, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &batch_sigset, &old_sigset);
+    /* Without the thread, the signals are let through as before. */
+    int signals = !pthread_create(&signal_thread, NULL, batch_signals, &b);
+    if (!signals) pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+#endif
+    int started = 1;
+    while (started < workers && !pthread_create(&pool[started].thread, NULL, batch_work, &pool[started])) started++;
+    batch_work(&pool[0]);
+    for (int i = 1; i < started; i++) pthread_join(pool[i].thread, NULL);
+#ifdef BATCH_SIGNALS
+    if (signals) {
+        pthread_cancel(signal_thread);
+        pthread_join(signal_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+    }
+#endif
+    pthread_cond_destroy(&b.written);
+    pthread_mutex_destroy(&b.lock);
+#else
+    batch_work(&pool[0]);
+#endif
+    running_batch = NULL;
+
+    for (int i = 0; i < workers; i++) {
+        if (pool[i].state != NULL) bz3_free(pool[i].state);
+        free(pool[i].buffer);
+    }
+    free(pool);
+    return b.status;
+}
+
+struct file_list {
+    char ** names;
+    int n, capacity;
+};
+
+static void add_file(struct file_list * list, char * name) {
+    if (list->n == list->capacity) {
+        int capacity = list->capacity ? 2 * list->capacity : 64;
+        char ** names = realloc(list->names, capacity * sizeof(char *));
+        if (!names) {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            exit(1);
+        }
+        list->names = names;
+        list->capacity = capacity;
+    }
+    list->names[list->n++] = name;
+}
+
+static int compare_names(const void * a, const void * b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Add the regular files under `path' to `list', in name order. Symbolic links to directories are not followed. When
+   compressing, .bz3 files are passed over; otherwise, only .bz3 files are taken. */
+static void walk_directory(struct file_list * list, const char * path, int mode) {
+    DIR * dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Error: failed to open directory `%s': %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    struct file_list entries = { 0 };
+    size_t length = strlen(path);
+    if (length && path[length - 1] == '/') length--;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        char * name = malloc(length + strlen(entry->d_name) + 2);
+        if (!name) {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            exit(1);
+        }
+        memcpy(name, path, length);
+        name[length] = '/';
+        strcpy(name + length + 1, entry->d_name);
+        add_file(&entries, name);
+    }
+    closedir(dir);
+    if (entries.n) qsort(entries.names, entries.n, sizeof(char *), compare_names);
+
+    for (int i = 0; i < entries.n; i++) {
+        char * name = entries.names[i];
+        struct stat st;
+        if (!lstat(name, &st) && S_ISDIR(st.st_mode)) {
+            walk_directory(list, name, mode);
+            free(name);
+        } else if (stat(name, &st) || !S_ISREG(st.st_mode) || (mode == MODE_ENCODE) == has_bz3_extension(name)) {
+            free(name);
+        } else {
+            add_file(list, name);
+        }
+    }
+    free(entries.names);
+}
+
+/* Replace the directories among `args' with the files in them, for -R. */
+static char ** expand_files(char ** args, int n_args, int mode, int * n_files) {
+    struct file_list list = { 0 };
+    for (int i = 0; i < n_args; i++) {
+        if (is_dir(args[i]))
+            walk_directory(&list, args[i], mode);
+        else
+            add_file(&list, args[i]);
+    }
+    *n_files = list.n;
+    return list.names;
+}
+
 int main(int argc, char * argv[]) {
     int mode = MODE_ENCODE;
 
@@ -551,32 +2185,77 @@ int main(int argc, char * argv[]) {
     int force = 0;
 
     // command line arguments
-    int force_stdstreams = 0, workers = 0, batch = 0, verbose = 0, remove_input_file = 0;
-
-    // the block size
-    u32 block_size = MiB(16);
-
-    enum { RM_OPTION = CHAR_MAX + 1 };
+    int force_stdstreams = 0, workers = 0, batch = 0, verbose = 0, remove_input_file = 0, flags = 0, numa = 0;
+    int recursive = 0;
+    int io = IO_STDIO;
+
+    // the block size, 0 until set by -b; and the compression level
+    u32 block_size = 0;
+    int level = BZ3_LEVEL_DEFAULT;
+
+    // the memory limit in bytes, 0 if unlimited
+    uint64_t memlimit = bz3_memory_limit();
+
+    // the dictionary to write with --train
+    char * train_output = NULL;
+
+    enum {
+        RM_OPTION = CHAR_MAX + 1,
+        LOWMEM_OPTION,
+        MEMLIMIT_OPTION,
+        NUMA_OPTION,
+        TRAIN_OPTION,
+        IO_OPTION,
+        SYNC_OPTION,
+        NOCACHE_OPTION,
+        SPLIT_OPTION,
+        RAMP_OPTION
+    };
 
     yarg_options opt[] = {
-        {       'e', no_argument,       "encode" },
-        {       'z', no_argument,       "encode" }, /* alias */
-        {       'd', no_argument,       "decode" },
-        {       't', no_argument,       "test" },
-        {       'c', no_argument,       "stdout" },
-        {       'f', no_argument,       "force" },
-        {       'r', no_argument,       "recover" },
-        {       'h', no_argument,       "help" },
-        { RM_OPTION, no_argument,       "rm" },
-        {       'k', no_argument,       "keep" },
-        {       'V', no_argument,       "version" },
-        {       'v', no_argument,       "verbose" },
-        {       'b', required_argument, "block" },
-        {       'B', no_argument,       "batch" },
+        {             'e', no_argument,       "encode" },
+        {             'z', no_argument,       "encode" }, /* alias */
+        {             'd', no_argument,       "decode" },
+        {             't', no_argument,       "test" },
+        {             'c', no_argument,       "stdout" },
+        {             'f', no_argument,       "force" },
+        {             'r', no_argument,       "recover" },
+        {             'h', no_argument,       "help" },
+        {       RM_OPTION, no_argument,       "rm" },
+        {             'k', no_argument,       "keep" },
+        {             'V', no_argument,       "version" },
+        {             'v', no_argument,       "verbose" },
+        {             'b', required_argument, "block" },
+        {             'B', no_argument,       "batch" },
+        {             'R', no_argument,       "recursive" },
+        {   LOWMEM_OPTION, no_argument,       "lowmem" },
+        { MEMLIMIT_OPTION, required_argument, "memlimit" },
+        {    TRAIN_OPTION, required_argument, "train" },
+        {     SYNC_OPTION, required_argument, "sync" },
+        {     RAMP_OPTION, no_argument,       "ramp" },
 #ifdef PTHREAD
-        {       'j', required_argument, "jobs" },
+        {             'j', required_argument, "jobs" },
+        {    SPLIT_OPTION, no_argument,       "split" },
+#endif
+        {             '1', no_argument,       "fast" },
+        {             '2', no_argument,       NULL },
+        {             '3', no_argument,       NULL },
+        {             '4', no_argument,       NULL },
+        {             '5', no_argument,       NULL },
+        {             '6', no_argument,       NULL },
+        {             '7', no_argument,       NULL },
+        {             '8', no_argument,       NULL },
+        {             '9', no_argument,       "best" },
+#ifdef NUMA_PLACEMENT
+        {     NUMA_OPTION, no_argument,       "numa" },
 #endif
-        {         0, no_argument,       NULL }
+#ifdef IO_URING
+        {       IO_OPTION, required_argument, "io" },
+#endif
+#ifdef __linux__
+        {  NOCACHE_OPTION, no_argument,       "nocache" },
+#endif
+        {               0, no_argument,       NULL }
     };
     yarg_settings settings = {
         .dash_dash = true,
@@ -603,10 +2282,37 @@ int main(int argc, char * argv[]) {
             case 'c': force_stdstreams = 1; break;
             case 'f': force = 1; break;
             case RM_OPTION: remove_input_file = 1; break;
+            case LOWMEM_OPTION: flags |= BZ3_FLAG_LOW_MEMORY; break;
+            case MEMLIMIT_OPTION:
+                if (!res->args[i].arg || !is_numeric(res->args[i].arg)) {
+                    fprintf(stderr, "bzip3: invalid memory limit: %s\n", res->args[i].arg ? res->args[i].arg : "");
+                    return 1;
+                }
+                memlimit = (uint64_t)strtoull(res->args[i].arg, NULL, 10) * MiB(1);
+                memlimit_given = 1;
+                break;
+            case TRAIN_OPTION: train_output = res->args[i].arg; break;
+            case RAMP_OPTION: ramp = 1; break;
+            case SYNC_OPTION:
+                if (res->args[i].arg && !strcmp(res->args[i].arg, "always"))
+                    sync_mode = SYNC_ALWAYS;
+                else if (res->args[i].arg && !strcmp(res->args[i].arg, "deferred"))
+                    sync_mode = SYNC_DEFERRED;
+                else if (res->args[i].arg && !strcmp(res->args[i].arg, "none"))
+                    sync_mode = SYNC_NONE;
+                else {
+                    fprintf(stderr, "bzip3: invalid sync mode: %s\n", res->args[i].arg ? res->args[i].arg : "");
+                    return 1;
+                }
+                break;
+            case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+                level = res->args[i].opt - '0';
+                break;
             case 'k': break;
             case 'h': help(); return 0;
             case 'V': version(); return 0;
             case 'B': batch = 1; break;
+            case 'R': recursive = batch = 1; break;
             case 'v': verbose = 1; break;
             case 'b':
                 if (!is_numeric(res->args[i].arg)) {
@@ -617,12 +2323,37 @@ int main(int argc, char * argv[]) {
                 break;
 #ifdef PTHREAD
             case 'j':
+                if (!strcmp(res->args[i].arg, "auto")) {
+                    workers = JOBS_AUTO;
+                    break;
+                }
                 if (!is_numeric(res->args[i].arg)) {
                     fprintf(stderr, "bzip3: invalid amount of jobs: %s\n", res->args[i].arg);
                     return 1;
                 }
                 workers = atoi(res->args[i].arg);
                 break;
+            case SPLIT_OPTION: split = 1; break;
+#endif
+#ifdef NUMA_PLACEMENT
+            case NUMA_OPTION: numa = 1; break;
+#endif
+#ifdef __linux__
+            case NOCACHE_OPTION: nocache = 1; break;
+#endif
+#ifdef IO_URING
+            case IO_OPTION:
+                if (res->args[i].arg && !strcmp(res->args[i].arg, "stdio"))
+                    io = IO_STDIO;
+                else if (res->args[i].arg && !strcmp(res->args[i].arg, "uring"))
+                    io = IO_URING_ENGINE;
+                else if (res->args[i].arg && !strcmp(res->args[i].arg, "direct"))
+                    io = IO_DIRECT;
+                else {
+                    fprintf(stderr, "bzip3: unknown I/O engine: %s\n", res->args[i].arg ? res->args[i].arg : "");
+                    return 1;
+                }
+                break;
 #endif
         }
     }
@@ -632,97 +2363,133 @@ int main(int argc, char * argv[]) {
     setmode(STDOUT_FILENO, O_BINARY);
 #endif
 
+    if (train_output) {
+        if (!res->pos_argc) {
+            fprintf(stderr, "Error: no samples to train the dictionary on.\n");
+            return 1;
+        }
+        int r = train(train_output, res->pos_args, res->pos_argc, force, verbose);
+        finish_sync();
+        return r;
+    }
+
+    if (!block_size) block_size = bz3_level_block_size(level);
+
     if (block_size < KiB(65) || block_size > MiB(511)) {
         fprintf(stderr, "Block size must be between 65 KiB and 511 MiB.\n");
         return 1;
     }
 
+#ifdef NUMA_PLACEMENT
+    if (numa) {
+        numa = numa_init();
+        if (!numa) fprintf(stderr, "bzip3: NUMA topology unavailable, ignoring --numa.\n");
+        else if (verbose) fprintf(stderr, "NUMA: spreading jobs over %d node(s).\n", numa);
+    }
+#endif
+
     if (batch && res->pos_argc) {
-        switch (mode) {
-            case MODE_ENCODE:
-                /* Encode each of the files. */
-                for (int i = 0; i < res->pos_argc; i++) {
-                    char * arg = res->pos_args[i];
-
-                    FILE * input_des = open_input(arg);
-                    char * output_name;
-                    if (force_stdstreams)
-                        output_name = NULL;
-                    else {
-                        output_name = malloc(strlen(arg) + 5);
-                        if (!output_name) {
-                            fprintf(stderr, "Failed to allocate memory.\n");
-                            return 1;
+        char ** files = res->pos_args;
+        int n_files = res->pos_argc, status = 0;
+        if (recursive) files = expand_files(res->pos_args, res->pos_argc, mode, &n_files);
+
+        /* Writing everything to the standard output and recovering go one file after another. */
+        if (!force_stdstreams && mode != MODE_RECOVER) {
+            status = batch_process(files, n_files, mode, block_size, level, workers, flags, memlimit, force,
+                                   remove_input_file, io, verbose);
+        } else {
+            switch (mode) {
+                case MODE_ENCODE:
+                    /* Encode each of the files. */
+                    for (int i = 0; i < n_files; i++) {
+                        char * arg = files[i];
+
+                        FILE * input_des = open_input(arg, io);
+                        char * output_name;
+                        if (force_stdstreams)
+                            output_name = NULL;
+                        else {
+                            output_name = malloc(strlen(arg) + 5);
+                            if (!output_name) {
+                                fprintf(stderr, "Failed to allocate memory.\n");
+                                return 1;
+                            }
+                            strcpy(output_name, arg);
+                            strcat(output_name, ".bz3");
                         }
-                        strcpy(output_name, arg);
-                        strcat(output_name, ".bz3");
-                    }
 
-                    FILE * output_des = open_output(output_name, force);
-                    process(input_des, output_des, mode, block_size, workers, verbose, arg);
+                        FILE * output_des = open_output(output_name, force, io);
+                        int r = process(input_des, output_des, mode, block_size, level, workers, flags, memlimit,
+                                        numa, verbose, arg);
 
-                    fclose(input_des);
-                    close_out_file(output_des);
-                    if (!force_stdstreams) free(output_name);
-                    if (remove_input_file) {
-                        remove_in_file(arg, output_des);
-                    }
-                }
-                break;
-            case MODE_RECOVER:
-            case MODE_DECODE:
-                /* Decode each of the files. */
-                for (int i = 0; i < res->pos_argc; i++) {
-                    char * arg = res->pos_args[i];
-
-                    FILE * input_des = open_input(arg);
-                    char * output_name;
-                    if (force_stdstreams)
-                        output_name = NULL;
-                    else {
-                        output_name = malloc(strlen(arg) + 1);
-                        if (!output_name) {
-                            fprintf(stderr, "Failed to allocate memory.\n");
-                            return 1;
+                        close_in_file(input_des);
+                        close_out_file(output_des);
+                        if (!force_stdstreams) free(output_name);
+                        if (r == 0 && remove_input_file) {
+                            remove_in_file(arg, output_des);
                         }
-                        strcpy(output_name, arg);
-                        if (strlen(output_name) > 4 && !strcmp(output_name + strlen(output_name) - 4, ".bz3"))
-                            output_name[strlen(output_name) - 4] = 0;
+                        status |= r;
+                    }
+                    break;
+                case MODE_RECOVER:
+                case MODE_DECODE:
+                    /* Decode each of the files. */
+                    for (int i = 0; i < n_files; i++) {
+                        char * arg = files[i];
+
+                        FILE * input_des = open_input(arg, io);
+                        char * output_name;
+                        if (force_stdstreams)
+                            output_name = NULL;
                         else {
-                            fprintf(stderr, "Warning: file %s has an unknown extension, skipping.\n", arg);
-                            return 1;
+                            output_name = malloc(strlen(arg) + 1);
+                            if (!output_name) {
+                                fprintf(stderr, "Failed to allocate memory.\n");
+                                return 1;
+                            }
+                            strcpy(output_name, arg);
+                            if (strlen(output_name) > 4 && !strcmp(output_name + strlen(output_name) - 4, ".bz3"))
+                                output_name[strlen(output_name) - 4] = 0;
+                            else {
+                                fprintf(stderr, "Warning: file %s has an unknown extension, skipping.\n", arg);
+                                return 1;
+                            }
                         }
-                    }
 
-                    FILE * output_des = open_output(output_name, force);
-                    process(input_des, output_des, mode, block_size, workers, verbose, arg);
+                        FILE * output_des = open_output(output_name, force, io);
+                        int r = process(input_des, output_des, mode, block_size, level, workers, flags, memlimit,
+                                        numa, verbose, arg);
 
-                    fclose(input_des);
-                    close_out_file(output_des);
-                    if (!force_stdstreams) free(output_name);
-                    if (remove_input_file) {
-                        remove_in_file(arg, output_des);
+                        close_in_file(input_des);
+                        close_out_file(output_des);
+                        if (!force_stdstreams) free(output_name);
+                        if (r == 0 && remove_input_file) {
+                            remove_in_file(arg, output_des);
+                        }
+                        status |= r;
                     }
-                }
-                break;
-            case MODE_TEST:
-                /* Test each of the files. */
-                for (int i = 0; i < res->pos_argc; i++) {
-                    char * arg = res->pos_args[i];
-
-                    FILE * input_des = open_input(arg);
-                    process(input_des, NULL, mode, block_size, workers, verbose, arg);
-                    fclose(input_des);
-                }
-                break;
+                    break;
+                case MODE_TEST:
+                    /* Test each of the files. */
+                    for (int i = 0; i < n_files; i++) {
+                        char * arg = files[i];
+
+                        FILE * input_des = open_input(arg, io);
+                        status |= process(input_des, NULL, mode, block_size, level, workers, flags, memlimit, numa,
+                                          verbose, arg);
+                        close_in_file(input_des);
+                    }
+                    break;
+            }
         }
 
+        finish_sync();
         if (fclose(stdout)) {
             fprintf(stderr, "Error: Failed on fclose(stdout): %s\n", strerror(errno));
             return 1;
         }
 
-        return 0;
+        return status;
     }
 
     for (int i = 0; i < res->pos_argc; i++) {
@@ -794,21 +2561,22 @@ int main(int argc, char * argv[]) {
 
     FILE *input_des = NULL, *output_des = NULL;
 
-    input_des = open_input(input);
-    output_des = mode != MODE_TEST ? open_output(output, force) : NULL;
+    input_des = open_input(input, io);
+    output_des = mode != MODE_TEST ? open_output(output, force, io) : NULL;
 
     if (output != f2) free(output);
 
-    int r = process(input_des, output_des, mode, block_size, workers, verbose, input);
+    int r = process(input_des, output_des, mode, block_size, level, workers, flags, memlimit, numa, verbose, input);
 
-    fclose(input_des);
+    close_in_file(input_des);
     close_out_file(output_des);
     if (fclose(stdout)) {
         fprintf(stderr, "Error: Failed on fclose(stdout): %s\n", strerror(errno));
         return 1;
     }
-    if (remove_input_file) {
+    if (r == 0 && remove_input_file) {
         remove_in_file(input, output_des);
     }
+    finish_sync();
     return r;
 }